@@ -21,5 +21,33 @@ Boston, MA 02111-1307, USA.  */
 
 typedef unsigned long crc_t;
 
+/* The value computed by one of the hash algorithms of CRC files.  A
+   32-bit CRC is zero-extended. */
+
+__extension__ typedef unsigned long long hash_t;
+
+/* Hash algorithms of CRC files. */
+
+#define HASH_CRC32      0       /* 32-bit CRC, see crc_compute() */
+#define HASH_XXH64      1       /* 64-bit xxHash (XXH64, seed 0) */
+
+/* State of an incremental computation of a hash. */
+
+typedef struct
+{
+  int alg;                      /* HASH_* */
+  crc_t crc;                    /* HASH_CRC32 */
+  hash_t acc[4];                /* HASH_XXH64: Accumulators */
+  hash_t total;                 /* HASH_XXH64: Number of bytes */
+  unsigned char buf[32];        /* HASH_XXH64: Incomplete stripe */
+  unsigned buf_len;             /* HASH_XXH64: Bytes in BUF */
+} hash_state;
+
 void crc_build_table (void);
 crc_t crc_compute (const unsigned char *src, size_t size);
+crc_t crc_update (crc_t crc, const unsigned char *src, size_t size);
+crc_t crc_combine (crc_t crc1, crc_t crc2, unsigned long len2);
+void hash_init (hash_state *h, int alg);
+void hash_update (hash_state *h, const unsigned char *src, size_t size);
+hash_t hash_final (hash_state *h);
+hash_t hash_compute (int alg, const unsigned char *src, size_t size);
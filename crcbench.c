@@ -0,0 +1,160 @@
+/* crcbench.c -- Measure the speed of crc_compute()
+   Copyright (c) 1995-1996 by Eberhard Mattes
+
+This file is part of fst.
+
+fst is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+fst is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with fst; see the file COPYING.  If not, write to
+the Free Software Foundation, 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.  */
+
+
+/* This program compares crc_compute() to the byte-wise algorithm
+   used by older versions of fst (one table lookup per byte).  It shows
+   bytes per CPU cycle (x86 with GCC) or megabytes per second
+   (otherwise) for 512-byte sectors and for 1 MB buffers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "crc.h"
+
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+#define BENCH_RDTSC
+#include <x86intrin.h>
+#endif
+
+#define CRC_POLYNOMIAL 0x4c11db7
+
+/* Total number of bytes processed per measurement. */
+
+#define BENCH_BYTES     (64L * 1024 * 1024)
+
+static crc_t byte_table[256];
+
+/* The results are stored here to keep the compiler from discarding
+   the computations. */
+
+static volatile crc_t bench_sink;
+
+
+/* Build the table of the byte-wise algorithm. */
+
+static void byte_build_table (void)
+{
+  int i, j;
+  crc_t t;
+
+  byte_table[0] = 0;
+  for (i = 0, j = 0; i < 128; ++i, j += 2)
+    {
+      t = (byte_table[i] << 1) & 0xffffffff;
+      if (byte_table[i] & 0x80000000)
+        {
+          byte_table[j+0] = t ^ CRC_POLYNOMIAL;
+          byte_table[j+1] = t;
+        }
+      else
+        {
+          byte_table[j+0] = t;
+          byte_table[j+1] = t ^ CRC_POLYNOMIAL;
+        }
+    }
+}
+
+
+/* The byte-wise algorithm. */
+
+static crc_t byte_compute (const unsigned char *src, size_t size)
+{
+  size_t i;
+  crc_t crc;
+
+  crc = 0xffffffff;
+  for (i = 0; i < size; ++i)
+    crc = ((crc << 8) & 0xffffffff) ^ byte_table[(crc >> 24) ^ src[i]];
+  return ~crc & 0xffffffff;
+}
+
+
+/* Return a time stamp: CPU cycles or clock ticks. */
+
+static double bench_time (void)
+{
+#ifdef BENCH_RDTSC
+  return (double)__rdtsc ();
+#else
+  return (double)clock ();
+#endif
+}
+
+
+/* Process BENCH_BYTES bytes in pieces of SIZE bytes at BUF with the
+   algorithm FUN and show the speed. */
+
+static void bench (const char *name, crc_t (*fun)(const unsigned char *,
+                                                    size_t),
+                    const unsigned char *buf, size_t size)
+{
+  long i, n;
+  double t0, t1;
+
+  n = BENCH_BYTES / (long)size;
+  t0 = bench_time ();
+  for (i = 0; i < n; ++i)
+    bench_sink = fun (buf, size);
+  t1 = bench_time ();
+#ifdef BENCH_RDTSC
+  printf ("  %-12s %8.3f bytes/cycle\n", name,
+          (double)n * (double)size / (t1 - t0));
+#else
+  printf ("  %-12s %8.1f MB/s\n", name,
+          (double)n * (double)size / 1048576.0
+          / ((t1 - t0) / CLOCKS_PER_SEC));
+#endif
+}
+
+
+int main (void)
+{
+  static const size_t sizes[2] = {512, 1048576};
+  unsigned char *buf;
+  size_t i;
+  int k;
+
+  crc_build_table ();
+  byte_build_table ();
+  buf = malloc (sizes[1]);
+  if (buf == NULL)
+    {
+      fputs ("Out of memory\n", stderr);
+      return 2;
+    }
+  srand (1);
+  for (i = 0; i < sizes[1]; ++i)
+    buf[i] = (unsigned char)rand ();
+  for (k = 0; k < 2; ++k)
+    {
+      if (crc_compute (buf, sizes[k]) != byte_compute (buf, sizes[k]))
+        {
+          fputs ("crc_compute() does not match the byte-wise algorithm\n",
+                 stderr);
+          return 1;
+        }
+      printf ("Buffers of %lu bytes:\n", (unsigned long)sizes[k]);
+      bench ("byte-wise", byte_compute, buf, sizes[k]);
+      bench ("crc_compute", crc_compute, buf, sizes[k]);
+    }
+  free (buf);
+  return 0;
+}
@@ -0,0 +1,114 @@
+/* crctest.c -- Check crc_compute() and crc_update()
+   Copyright (c) 1995-1996 by Eberhard Mattes
+
+This file is part of fst.
+
+fst is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+fst is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with fst; see the file COPYING.  If not, write to
+the Free Software Foundation, 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.  */
+
+
+/* This program compares crc_compute() and crc_update() to a bit-wise
+   computation of the CRC on random buffers at random offsets.  Buffers
+   of 64 bytes or more use the PCLMULQDQ kernel if the CPU supports
+   it, shorter buffers and the tails use the slicing-by-8 tables.
+   Exit with status 1 if there is a mismatch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "crc.h"
+
+#define CRC_POLYNOMIAL 0x4c11db7
+
+/* Number of random buffers and maximum buffer size. */
+
+#define TEST_COUNT      20000
+#define TEST_MAX_SIZE   4096
+
+
+/* Compute the CRC of the SIZE bytes at SRC one bit at a time. */
+
+static crc_t bit_compute (const unsigned char *src, size_t size)
+{
+  size_t i;
+  int j;
+  crc_t crc;
+
+  crc = 0xffffffff;
+  for (i = 0; i < size; ++i)
+    {
+      crc ^= (crc_t)src[i] << 24;
+      for (j = 0; j < 8; ++j)
+        if (crc & 0x80000000)
+          crc = ((crc << 1) & 0xffffffff) ^ CRC_POLYNOMIAL;
+        else
+          crc = (crc << 1) & 0xffffffff;
+    }
+  return ~crc & 0xffffffff;
+}
+
+
+int main (void)
+{
+  unsigned char *buf;
+  size_t i, offset, size, split;
+  crc_t expect;
+  long n, errors;
+
+  crc_build_table ();
+  buf = malloc (TEST_MAX_SIZE + 16);
+  if (buf == NULL)
+    {
+      fputs ("Out of memory\n", stderr);
+      return 2;
+    }
+  srand (1);
+  errors = 0;
+  for (n = 0; n < TEST_COUNT; ++n)
+    {
+      /* Use all the lengths up to 300 bytes, then random lengths. */
+
+      offset = (size_t)rand () % 16;
+      if (n <= 300)
+        size = (size_t)n;
+      else
+        size = (size_t)rand () % (TEST_MAX_SIZE + 1);
+      for (i = 0; i < size; ++i)
+        buf[offset+i] = (unsigned char)rand ();
+      expect = bit_compute (buf + offset, size);
+      if (crc_compute (buf + offset, size) != expect)
+        {
+          printf ("crc_compute: mismatch for %lu bytes at offset %lu\n",
+                  (unsigned long)size, (unsigned long)offset);
+          ++errors;
+        }
+      split = size == 0 ? 0 : (size_t)rand () % (size + 1);
+      if (crc_update (crc_compute (buf + offset, split),
+                      buf + offset + split, size - split) != expect)
+        {
+          printf ("crc_update: mismatch for %lu+%lu bytes at offset %lu\n",
+                  (unsigned long)split, (unsigned long)(size - split),
+                  (unsigned long)offset);
+          ++errors;
+        }
+    }
+  free (buf);
+  if (errors != 0)
+    {
+      printf ("%ld errors\n", errors);
+      return 1;
+    }
+  printf ("%d buffers OK\n", TEST_COUNT);
+  return 0;
+}
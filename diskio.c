@@ -21,6 +21,7 @@ Boston, MA 02111-1307, USA.  */
 
 #define INCL_DOSDEVIOCTL
 #define INCL_DOSDEVICES
+#define INCL_DOSPROCESS
 #include <os2.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,6 +44,36 @@ Boston, MA 02111-1307, USA.  */
 
 #define HASH_END        0xffffffff
 
+/* Maximum number of snapshot files in a chain of delta snapshot
+   files.  This also catches delta snapshot files which are (directly
+   or indirectly) their own base. */
+
+#define MAX_CHAIN       64
+
+/* Number of sectors read at once by diskio_snapshot_verify(). */
+
+#define VERIFY_CHUNK    128
+
+/* Number of consecutive sectors processed by one thread of
+   diskio_crc_sectors() (at least one block). */
+
+#define CRC_CHUNK       1024
+
+/* Number of consecutive sectors processed by one thread of
+   diskio_compare_sectors(). */
+
+#define CMP_CHUNK       1024
+
+/* Number of sectors read from each disk at a time by
+   diskio_compare_sectors(). */
+
+#define CMP_PIECE       64
+
+/* Number of sectors read from each file at a time by
+   diskio_snapshot_compare(). */
+
+#define SNAPSHOT_CMP_BATCH 2048
+
 /* Method for reading and writing sectors. */
 
 enum disk_io_type
@@ -79,10 +110,21 @@ struct diskio_track
 struct diskio_snapshot
 {
   HFILE hf;                     /* File handle */
+  char *fname;                  /* Name of the snapshot file */
   ULONG sector_count;           /* Total number of sectors */
+  ULONG data_count;             /* Number of sectors stored in the file */
+  ULONG map_pos;                /* Relative byte address of the sector table */
+  ULONG flags;                  /* SSF_* flags */
   ULONG *sector_map;            /* Table containing relative sector numbers */
+  ULONG *pos_map;               /* Positions in the file (delta) or NULL */
   ULONG *hash_next;             /* Hash chains */
   ULONG version;                /* Format version number */
+  ULONG map_crc;                /* CRC of the sector table */
+  ULONG pos_crc;                /* CRC of the position table (delta) */
+  ULONG hdr_map_crc;            /* CRCs of the tables (SSF_CHECK) */
+  ULONG hdr_pos_crc;
+  ULONG hdr_check_crc;
+  DISKIO *base;                 /* Base snapshot (delta) or NULL */
   ULONG hash_start[HASH_SIZE];  /* Hash chain heads */
 };
 
@@ -92,7 +134,19 @@ struct diskio_crc
 {
   FILE *f;                      /* Stream */
   ULONG version;                /* Format version number */
-  crc_t *vec;                   /* See diskio_crc_load() */
+  int hash;                     /* Hash algorithm (HASH_*) */
+  ULONG entry_size;             /* Bytes per CRC in the file */
+  hash_t *vec;                  /* See diskio_crc_load() */
+  ULONG next;                   /* Index of the CRC at the file pointer */
+  ULONG block_sectors;          /* Sectors per leaf block */
+  ULONG fanout;                 /* Children per tree node, 0 if no tree */
+  ULONG levels;                 /* Number of levels, level 0 are leaves */
+  ULONG level_pos[CRC_MAX_LEVELS]; /* Position of each level */
+  ULONG level_count[CRC_MAX_LEVELS]; /* Number of CRCs of each level */
+  ULONG *ranges;                /* Start and count of each range or NULL */
+  ULONG *range_index;           /* Index of the first CRC of each range */
+  ULONG range_count;            /* Number of ranges (sparse CRC file) */
+  ULONG range_cur;              /* Range of the most recent crc_sec() */
 };
 
 /* DISKIO structure. */
@@ -159,6 +213,143 @@ ULONG save_sector_alloc;
 
 ULONG *save_sector_map;
 
+/* This table contains, for each element of save_sector_map, the
+   relative sector number of the sector in the save file, or 0 if the
+   sector is to be taken from the base snapshot file. */
+
+static ULONG *save_sector_pos;
+
+/* This table contains, for each sector actually written to the save
+   file, the CRC of the sector as stored in the file. */
+
+static crc_t *save_sector_check;
+
+/* Sectors per leaf block of the CRC file being written, 0 for a CRC
+   file of version 1 (one CRC per sector, no tree). */
+
+static ULONG save_crc_block;
+
+/* Hash algorithm of the CRC file being written. */
+
+static int save_crc_hash;
+
+/* Non-zero if the CRC file being written is sparse (version 3). */
+
+static char save_crc_is_sparse;
+
+/* Number of ranges of the sparse CRC file being written. */
+
+static ULONG save_crc_range_count;
+
+/* One bit per sector for save type SAVE_MAP, set for sectors
+   recorded by save_sec() and save_map_sectors(). */
+
+static BYTE *save_map;
+
+/* Number of sectors covered by save_map. */
+
+static ULONG save_map_total;
+
+/* Number of sectors of the image file (save type SAVE_IMAGE). */
+
+static ULONG save_image_total;
+
+/* Sector number at the current position of the image file. */
+
+static ULONG save_image_next;
+
+/* Greatest sector number in save_sector_map. */
+
+static ULONG save_sector_max;
+
+/* Number of sectors actually written to the save file. */
+
+static ULONG save_data_count;
+
+/* Base snapshot file for `save -b'.  If this is non-NULL, sectors
+   which are identical in the base snapshot file are not written to
+   the save file. */
+
+DISKIO *save_base;
+
+/* Name of the base snapshot file. */
+
+const char *save_base_fname;
+
+/* Nesting level of diskio_open() while opening a chain of delta
+   snapshot files. */
+
+static int chain_level;
+
+/* Work item for one thread of diskio_snapshot_verify(). */
+
+struct verify_job
+{
+  HFILE hf;                     /* File handle of this thread */
+  ULONG first;                  /* First relative sector number */
+  ULONG count;                  /* Number of sectors */
+  const crc_t *check;           /* Checksums of all sectors or NULL */
+  BYTE *bad;                    /* Set to 1 for bad sectors */
+  BYTE *buf;                    /* Buffer for VERIFY_CHUNK sectors */
+  ULONG rc;                     /* Return code of the first failure */
+  TID tid;                      /* Thread ID */
+};
+
+/* Work item for one thread of diskio_crc_sectors().  The thread
+   processes the chunks FIRST_CHUNK, FIRST_CHUNK + STEP, and so on. */
+
+struct crc_job
+{
+  struct diskio_track *dt;      /* The disk */
+  hash_t *dst;                  /* CRC of the block at sector START */
+  int alg;                      /* Hash algorithm (HASH_*) */
+  ULONG start;                  /* First sector number */
+  ULONG count;                  /* Number of sectors */
+  ULONG block;                  /* Sectors per block */
+  ULONG chunk_blocks;           /* Blocks per chunk */
+  ULONG first_chunk;            /* First chunk of this thread */
+  ULONG step;                   /* Number of threads */
+  TRACKLAYOUT *playout;         /* Parameter for DSK_READTRACK */
+  BYTE *track_buf;              /* Buffer for one track */
+  ULONG rc;                     /* Return code of the first failure */
+  ULONG bad_sec;                /* Sector number of the first failure */
+  TID tid;                      /* Thread ID */
+};
+
+
+/* Work item for one thread of diskio_compare_sectors().  The thread
+   processes the chunks FIRST_CHUNK, FIRST_CHUNK + STEP, and so on. */
+
+struct cmp_job
+{
+  struct diskio_track *dt1;     /* The first disk */
+  struct diskio_track *dt2;     /* The second disk */
+  BYTE *diff;                   /* Result for the sector at START */
+  ULONG start;                  /* First sector number */
+  ULONG count;                  /* Number of sectors */
+  ULONG first_chunk;            /* First chunk of this thread */
+  ULONG step;                   /* Number of threads */
+  TRACKLAYOUT *playout1;        /* Parameter for DSK_READTRACK, DT1 */
+  TRACKLAYOUT *playout2;        /* Parameter for DSK_READTRACK, DT2 */
+  BYTE *buf1;                   /* Buffer for CMP_PIECE sectors of DT1 */
+  BYTE *buf2;                   /* Buffer for CMP_PIECE sectors of DT2 */
+  ULONG rc;                     /* Return code of the first failure */
+  ULONG bad_sec;                /* Sector number of the first failure */
+  TID tid;                      /* Thread ID */
+};
+
+
+/* A sector present in both snapshot files compared by
+   diskio_snapshot_compare(). */
+
+struct snapshot_pair
+{
+  ULONG sec;                    /* Sector number */
+  ULONG pos1;                   /* Position in the first file, 0 if base */
+  ULONG pos2;                   /* Position in the second file, 0 if base */
+  ULONG slot;                   /* Index of the data of the first file */
+};
+
 
 /* Return the drive letter of a file name, if any, as upper-case
    letter.  Return 0 if there is no drive letter. */
@@ -186,6 +377,201 @@ static char cur_drive (void)
 }
 
 
+/* Return the length of the directory part (including the drive name
+   and the trailing backslash) of the file name FNAME. */
+
+static size_t fname_dir_len (const char *fname)
+{
+  size_t i, len;
+
+  len = 0;
+  for (i = 0; fname[i] != 0; ++i)
+    if (fname[i] == '\\' || fname[i] == '/' || fname[i] == ':')
+      len = i + 1;
+  return len;
+}
+
+
+/* Return true iff the file name FNAME does not depend on the current
+   working directory of the current drive. */
+
+static int fname_absolute (const char *fname)
+{
+  return (fname[0] == '\\' || fname[0] == '/'
+          || (isalpha ((unsigned char)fname[0]) && fname[1] == ':'));
+}
+
+
+/* Open the base snapshot file of the delta snapshot file FNAME
+   associated with D.  HDR points to the header of the delta snapshot
+   file.  Check that the base snapshot file is the one the delta
+   snapshot file has been created against. */
+
+static void snapshot_open_base (DISKIO *d, PCSZ fname, const header *hdr)
+{
+  char temp;
+  char base_fname[sizeof (hdr->s.base_fname)];
+  size_t len;
+  DISKIO *base;
+
+  /* A relative name of the base snapshot file is relative to the
+     directory containing the delta snapshot file. */
+
+  memcpy (base_fname, hdr->s.base_fname, sizeof (base_fname));
+  base_fname[sizeof (base_fname) - 1] = 0;
+  if (!fname_absolute (base_fname))
+    {
+      len = fname_dir_len ((const char *)fname);
+      if (len + strlen (base_fname) >= sizeof (base_fname))
+        error ("Name of base snapshot file of %s too long", fname);
+      memmove (base_fname + len, base_fname, strlen (base_fname) + 1);
+      memcpy (base_fname, fname, len);
+    }
+  if (++chain_level > MAX_CHAIN)
+    error ("Chain of delta snapshot files too long at %s", fname);
+  temp = write_enable; write_enable = FALSE;
+  base = diskio_open ((PCSZ)base_fname, DIO_SNAPSHOT, FALSE);
+  write_enable = temp;
+  --chain_level;
+  if (base->x.snapshot.sector_count
+      != ULONG_FROM_FS (hdr->s.base_sector_count)
+      || base->x.snapshot.map_crc != ULONG_FROM_FS (hdr->s.base_map_crc))
+    error ("%s is not the base snapshot file of %s", base_fname, fname);
+  d->x.snapshot.base = base;
+}
+
+
+/* Return the number of bytes of a CRC (or hash) computed with the
+   hash algorithm ALG, as stored in a CRC file. */
+
+static ULONG crc_entry_size (int alg)
+{
+  return alg == HASH_CRC32 ? 4 : 8;
+}
+
+
+/* Convert COUNT CRCs computed with the hash algorithm ALG in place
+   from the format of CRC files (little endian, see crc_entry_size())
+   to hash_t. */
+
+static void hash_from_fs (hash_t *v, ULONG count, int alg)
+{
+  ULONG lo, hi;
+
+  if (alg == HASH_CRC32)
+    {
+      /* Work backwards as the elements grow. */
+
+      while (count != 0)
+        {
+          --count;
+          memcpy (&lo, (BYTE *)v + 4 * count, 4);
+          v[count] = ULONG_FROM_FS (lo);
+        }
+    }
+  else
+    {
+      for (; count != 0; ++v, --count)
+        {
+          memcpy (&lo, (BYTE *)v + 0, 4);
+          memcpy (&hi, (BYTE *)v + 4, 4);
+          *v = ((hash_t)ULONG_FROM_FS (hi) << 32) | ULONG_FROM_FS (lo);
+        }
+    }
+}
+
+
+/* Convert COUNT CRCs computed with the hash algorithm ALG from SRC to
+   the format of CRC files, storing them to DST. */
+
+static void hash_to_fs (BYTE *dst, const hash_t *src, ULONG count, int alg)
+{
+  ULONG lo, hi;
+
+  for (; count != 0; ++src, --count)
+    {
+      lo = ULONG_TO_FS ((ULONG)*src);
+      memcpy (dst, &lo, 4); dst += 4;
+      if (alg != HASH_CRC32)
+        {
+          hi = ULONG_TO_FS ((ULONG)(*src >> 32));
+          memcpy (dst, &hi, 4); dst += 4;
+        }
+    }
+}
+
+
+/* Compute the layout of the CRC tree of a CRC file (version 2) for
+   TOTAL sectors, BLOCK sectors per leaf block, FANOUT children per
+   node, and SIZE bytes per CRC.  Level 0 contains the CRCs of the leaf
+   blocks, each node of the next level contains the CRC of the CRCs
+   (in file byte order) of up to FANOUT nodes of the level below, the
+   last level contains the root only.  The levels are stored one after
+   the other, starting at the end of the header.  Store the positions
+   and the numbers of CRCs to POS and COUNT, return the number of
+   levels. */
+
+static ULONG crc_tree_layout (ULONG total, ULONG block, ULONG fanout,
+                              ULONG size, ULONG *pos, ULONG *count)
+{
+  ULONG levels, n, p;
+
+  n = DIVIDE_UP (total, block); p = 512; levels = 0;
+  for (;;)
+    {
+      if (levels >= CRC_MAX_LEVELS)
+        error ("CRC tree too deep");
+      pos[levels] = p; count[levels] = n; ++levels;
+      if (n <= 1)
+        break;
+      p += n * size;
+      n = DIVIDE_UP (n, fanout);
+    }
+  return levels;
+}
+
+
+/* Read the range table of the sparse CRC file (version 3) FNAME
+   associated with D.  The file has COUNT ranges.  The range table
+   follows the header; it contains the first sector number and the
+   number of sectors of each range, sorted by sector number.  The CRCs
+   of the sectors of all ranges (one CRC per sector) follow the range
+   table. */
+
+static void crc_read_ranges (DISKIO *d, PCSZ fname, ULONG count)
+{
+  ULONG i, n, start, len, end;
+
+  if (count > d->total_sectors)
+    error ("%s is damaged", fname);
+  d->x.crc.ranges = xmalloc (2 * count * sizeof (ULONG) + 1);
+  d->x.crc.range_index = xmalloc (count * sizeof (ULONG) + 1);
+  if (fseek (d->x.crc.f, 512, SEEK_SET) != 0
+      || fread (d->x.crc.ranges, sizeof (ULONG), 2 * count, d->x.crc.f)
+      != 2 * count)
+    error ("Cannot read CRC file");
+  n = 0; end = 0;
+  for (i = 0; i < count; ++i)
+    {
+      start = ULONG_FROM_FS (d->x.crc.ranges[2*i+0]);
+      len = ULONG_FROM_FS (d->x.crc.ranges[2*i+1]);
+      if (start < end || len == 0 || len > d->total_sectors
+          || start > d->total_sectors - len)
+        error ("%s is damaged", fname);
+      d->x.crc.ranges[2*i+0] = start;
+      d->x.crc.ranges[2*i+1] = len;
+      d->x.crc.range_index[i] = n;
+      end = start + len; n += len;
+    }
+  d->x.crc.range_count = count;
+  d->x.crc.block_sectors = 1;
+  d->x.crc.fanout = 0;
+  d->x.crc.levels = 1;
+  d->x.crc.level_pos[0] = 512 + 2 * count * sizeof (ULONG);
+  d->x.crc.level_count[0] = n;
+}
+
+
 /* Obtain access to a disk, snapshot file, or CRC file.  FNAME is the
    name of the disk or file to open.  FLAGS defines what types of
    files are allowed; FLAGS is the inclusive OR of one or more of
@@ -423,12 +809,24 @@ DISKIO *diskio_open (PCSZ fname, unsigned flags, int for_write)
           /* Check the header of a snapshot file and remember the
              values of the header. */
 
-          if (ULONG_FROM_FS (hdr.s.version) > 1)
+          if (ULONG_FROM_FS (hdr.s.version) > 2
+              || (ULONG_FROM_FS (hdr.s.flags) & ~(SSF_DELTA|SSF_CHECK)) != 0
+              || (ULONG_FROM_FS (hdr.s.version) < 2
+                  && (ULONG_FROM_FS (hdr.s.flags) & SSF_DELTA)))
             error ("Format of %s too new -- please upgrade this program",
                    fname);
           d->x.snapshot.hf = hf;
+          d->x.snapshot.fname = xmalloc (strlen ((const char *)fname) + 1);
+          strcpy (d->x.snapshot.fname, (const char *)fname);
           d->x.snapshot.sector_count = ULONG_FROM_FS (hdr.s.sector_count);
           d->x.snapshot.version = ULONG_FROM_FS (hdr.s.version);
+          d->x.snapshot.flags = ULONG_FROM_FS (hdr.s.flags);
+          d->x.snapshot.map_pos = ULONG_FROM_FS (hdr.s.map_pos);
+          d->x.snapshot.data_count = (d->x.snapshot.map_pos >= 512
+                                      ? d->x.snapshot.map_pos / 512 - 1 : 0);
+          d->x.snapshot.hdr_map_crc = ULONG_FROM_FS (hdr.s.map_crc);
+          d->x.snapshot.hdr_pos_crc = ULONG_FROM_FS (hdr.s.pos_crc);
+          d->x.snapshot.hdr_check_crc = ULONG_FROM_FS (hdr.s.check_crc);
           rc = DosSetFilePtr (hf, ULONG_FROM_FS (hdr.s.map_pos),
                               FILE_BEGIN, &pos);
           if (rc != 0)
@@ -446,9 +844,44 @@ DISKIO *diskio_open (PCSZ fname, unsigned flags, int for_write)
           if (nread != d->x.snapshot.sector_count * sizeof (ULONG))
             error ("Cannot read %s", fname);
 
+          /* The CRC of the sector table identifies the snapshot file
+             when it is used as base of a delta snapshot file. */
+
+          d->x.snapshot.map_crc
+            = crc_compute ((const unsigned char *)map,
+                           d->x.snapshot.sector_count * sizeof (ULONG));
+
           for (i = 0; i < d->x.snapshot.sector_count; ++i)
             map[i] = ULONG_FROM_FS (map[i]);
 
+          /* In a delta snapshot file, the sector table is followed by
+             a table of relative sector numbers.  Zero means that the
+             sector is to be taken from the base snapshot file. */
+
+          d->x.snapshot.pos_map = NULL;
+          d->x.snapshot.pos_crc = 0;
+          d->x.snapshot.base = NULL;
+          if (d->x.snapshot.version >= 2
+              && (ULONG_FROM_FS (hdr.s.flags) & SSF_DELTA))
+            {
+              map = xmalloc (d->x.snapshot.sector_count * sizeof (ULONG));
+              d->x.snapshot.pos_map = map;
+              rc = DosRead (hf, map,
+                            d->x.snapshot.sector_count * sizeof (ULONG),
+                            &nread);
+              if (rc != 0)
+                error ("Cannot read %s (rc=%lu)", fname, rc);
+              if (nread != d->x.snapshot.sector_count * sizeof (ULONG))
+                error ("Cannot read %s", fname);
+              d->x.snapshot.pos_crc
+                = crc_compute ((const unsigned char *)map,
+                               d->x.snapshot.sector_count * sizeof (ULONG));
+              for (i = 0; i < d->x.snapshot.sector_count; ++i)
+                map[i] = ULONG_FROM_FS (map[i]);
+              snapshot_open_base (d, fname, &hdr);
+              map = d->x.snapshot.sector_map;
+            }
+
           /* Initialize hashing. */
 
           for (i = 0; i < HASH_SIZE; ++i)
@@ -470,7 +903,7 @@ DISKIO *diskio_open (PCSZ fname, unsigned flags, int for_write)
           /* Check the header of a CRC file and remember the values of
              the header. */
 
-          if (ULONG_FROM_FS (hdr.c.version) > 1)
+          if (ULONG_FROM_FS (hdr.c.version) > 3)
             error ("Format of %s too new -- please upgrade this program",
                    fname);
 
@@ -491,11 +924,51 @@ DISKIO *diskio_open (PCSZ fname, unsigned flags, int for_write)
 
           d->total_sectors = ULONG_FROM_FS (hdr.c.sector_count);
           d->x.crc.version = ULONG_FROM_FS (hdr.c.version);
+          d->x.crc.hash = (int)ULONG_FROM_FS (hdr.c.hash);
+          if (ULONG_FROM_FS (hdr.c.hash) > HASH_XXH64)
+            error ("Hash algorithm of %s not supported -- please upgrade "
+                   "this program", fname);
+          d->x.crc.entry_size = crc_entry_size (d->x.crc.hash);
           d->x.crc.vec = NULL;  /* CRCs not read into memory */
+          d->x.crc.next = 0;
+          d->x.crc.ranges = NULL;
+          d->x.crc.range_index = NULL;
+          d->x.crc.range_count = 0;
+          d->x.crc.range_cur = 0;
+
+          /* A CRC file of version 1 contains one CRC per sector,
+             that is, just the leaves of the tree. */
+
+          if (d->x.crc.version < 2)
+            {
+              d->x.crc.block_sectors = 1;
+              d->x.crc.fanout = 0;
+              d->x.crc.levels = 1;
+              d->x.crc.level_pos[0] = 512;
+              d->x.crc.level_count[0] = d->total_sectors;
+              if (d->x.crc.hash != HASH_CRC32)
+                error ("%s is damaged", fname);
+            }
+          else if (d->x.crc.version == 3)
+            crc_read_ranges (d, fname, ULONG_FROM_FS (hdr.c.range_count));
+          else
+            {
+              d->x.crc.block_sectors = ULONG_FROM_FS (hdr.c.block_sectors);
+              d->x.crc.fanout = ULONG_FROM_FS (hdr.c.fanout);
+              if (d->x.crc.block_sectors == 0 || d->x.crc.fanout < 2
+                  || d->x.crc.fanout > CRC_MAX_FANOUT)
+                error ("%s is damaged", fname);
+              d->x.crc.levels
+                = crc_tree_layout (d->total_sectors, d->x.crc.block_sectors,
+                                   d->x.crc.fanout, d->x.crc.entry_size,
+                                   d->x.crc.level_pos, d->x.crc.level_count);
+              if (d->x.crc.levels != ULONG_FROM_FS (hdr.c.levels))
+                error ("%s is damaged", fname);
+            }
 
           /* Seek to the first CRC. */
 
-          fseek (d->x.crc.f, 512, SEEK_SET);
+          fseek (d->x.crc.f, d->x.crc.level_pos[0], SEEK_SET);
           d->type = DIOT_CRC;
           break;
 
@@ -536,12 +1009,24 @@ void diskio_close (DISKIO *d)
       break;
     case DIOT_SNAPSHOT:
       rc = DosClose (d->x.snapshot.hf);
+      free (d->x.snapshot.fname);
       free (d->x.snapshot.sector_map);
       free (d->x.snapshot.hash_next);
+      if (d->x.snapshot.pos_map != NULL)
+        free (d->x.snapshot.pos_map);
+      if (d->x.snapshot.base != NULL)
+        diskio_close (d->x.snapshot.base);
       break;
     case DIOT_CRC:
       if (fclose (d->x.crc.f) != 0)
         error ("fclose(): %s", strerror (errno));
+      if (d->x.crc.vec != NULL)
+        free (d->x.crc.vec);
+      if (d->x.crc.ranges != NULL)
+        {
+          free (d->x.crc.ranges);
+          free (d->x.crc.range_index);
+        }
       rc = 0;
       break;
     default:
@@ -623,127 +1108,1031 @@ ULONG *diskio_snapshot_sort (DISKIO *d)
 }
 
 
-/* Read all CRCs of the CRC file associated with D into memory, unless
-   there are too many CRCs.  This is used for speeding up
-   processing. */
-
-void diskio_crc_load (DISKIO *d)
-{
-  ULONG i;
-
-  if (d->type != DIOT_CRC || d->x.crc.vec != NULL)
-    abort ();
-  if (d->total_sectors * sizeof (crc_t) >= 8*1024*1024)
-    return;
-  d->x.crc.vec = xmalloc (d->total_sectors * sizeof (crc_t));
-  fseek (d->x.crc.f, 512, SEEK_SET);
-  if (fread (d->x.crc.vec, sizeof (crc_t), d->total_sectors,
-             d->x.crc.f) != d->total_sectors)
-    error ("Cannot read CRC file");
-  for (i = 0; i < d->total_sectors; ++i)
-    d->x.crc.vec[i] = ULONG_FROM_FS (d->x.crc.vec[i]);
-}
-
-
-/* Write the sector with number SEC and data SRC to the save file. */
+/* Thread of diskio_snapshot_verify().  ARG points to a struct
+   verify_job.  Read the sectors with large sequential reads and
+   compare the checksums.  This function must not use the C
+   library. */
 
-static void save_one_sec (const void *src, ULONG sec)
+static void APIENTRY verify_thread (ULONG arg)
 {
-  ULONG i;
-  BYTE raw[512];
+  struct verify_job *job;
+  ULONG rc, rel, end, n, i, pos, nread;
 
-  for (i = 0; i < save_sector_count; ++i)
-    if (save_sector_map[i] == sec)
-      return;
-  if (save_sector_count >= save_sector_alloc)
+  job = (struct verify_job *)arg;
+  rel = job->first; end = job->first + job->count;
+  while (rel < end)
     {
-      save_sector_alloc += 1024;
-      save_sector_map = realloc (save_sector_map,
-                                 save_sector_alloc * sizeof (ULONG));
-      if (save_sector_map == NULL)
-        error ("Out of memory");
+      n = MIN (end - rel, VERIFY_CHUNK);
+      rc = DosSetFilePtr (job->hf, rel * 512, FILE_BEGIN, &pos);
+      if (rc == 0)
+        rc = DosRead (job->hf, job->buf, n * 512, &nread);
+      if (rc != 0)
+        {
+          if (job->rc == 0)
+            job->rc = rc;
+          nread = 0;
+        }
+      for (i = 0; i < n; ++i)
+        if (i >= nread / 512
+            || (job->check != NULL
+                && (crc_compute (job->buf + 512 * i, 512)
+                    != job->check[rel + i - 1])))
+          job->bad[rel + i - 1] = 1;
+      rel += n;
     }
-  save_sector_map[save_sector_count++] = sec;
-  memcpy (raw, src, 512);
-
-  /* Scramble the signature so that there are no sectors with the
-     original HPFS sector signatures.  This simplifies recovering HPFS
-     file systems and undeleting files. */
-
-  *(ULONG *)raw ^= ULONG_TO_FS (SNAPSHOT_SCRAMBLE);
-  if (fwrite (raw, 512, 1, save_file) != 1)
-    save_error ();
 }
 
 
-/* Write COUNT sectors starting at number SEC to the save file. */
+/* Verify the snapshot file associated with D: Check the header, the
+   sector table, and the checksums of all the sectors.  The sectors
+   are read by THREADS threads, each reading a contiguous part of the
+   file.  The base snapshot file of a delta snapshot file is verified
+   as well.  Return the number of problems found. */
 
-void save_sec (const void *src, ULONG sec, ULONG count)
+ULONG diskio_snapshot_verify (DISKIO *d, int threads)
 {
-  const char *p;
+  struct diskio_snapshot *ds;
+  struct verify_job *jobs;
+  ULONG rc, action, size, table_pos, end, nread, problems, i, n, rel, slice;
+  ULONG *sort;
+  crc_t *check;
+  BYTE *bad;
+  int t;
 
-  p = (const char *)src;
-  while (count != 0)
+  if (d->type != DIOT_SNAPSHOT)
+    abort ();
+  ds = &d->x.snapshot;
+  n = ds->sector_count;
+  problems = 0;
+
+  /* Check the header against the size of the file. */
+
+  table_pos = ds->map_pos + n * sizeof (ULONG);
+  if (ds->pos_map != NULL)
+    table_pos += n * sizeof (ULONG);
+  end = table_pos;
+  if (ds->flags & SSF_CHECK)
+    end += ds->data_count * sizeof (crc_t);
+  rc = DosSetFilePtr (ds->hf, 0, FILE_END, &size);
+  if (rc != 0)
+    error ("Cannot read %s (rc=%lu)", ds->fname, rc);
+  if (ds->map_pos % 512 != 0 || ds->map_pos == 0
+      || (ds->pos_map == NULL && ds->data_count != n))
     {
-      save_one_sec (p, sec);
-      p += 512; ++sec; --count;
+      warning (1, "%s: Header does not match the sector table", ds->fname);
+      ++problems;
+    }
+  if (size < end)
+    {
+      warning (1, "%s: File is truncated (%lu bytes instead of %lu)",
+               ds->fname, size, end);
+      ++problems;
     }
-}
 
+  /* Each sector must be stored only once.  In a delta snapshot file,
+     the positions must be in range. */
+
+  sort = diskio_snapshot_sort (d);
+  for (i = 1; i < n; ++i)
+    if (sort[i] == sort[i-1])
+      {
+        warning (1, "%s: Sector #%lu stored more than once",
+                 ds->fname, sort[i]);
+        ++problems;
+      }
+  free (sort);
+  if (ds->pos_map != NULL)
+    for (i = 0; i < n; ++i)
+      if (ds->pos_map[i] > ds->data_count)
+        {
+          warning (1, "%s: Sector #%lu has a bad position",
+                   ds->fname, ds->sector_map[i]);
+          ++problems;
+        }
 
-/* Create a save file of type TYPE.  The file name is passed in the
-   global variable `save_fname'.  Complain if the file would be on the
-   drive AVOID_FNAME. */
+  /* Check the tables and load the checksums. */
 
-void save_create (const char *avoid_fname, enum save_type type)
-{
-  char drive;
-  header hdr;
+  check = NULL;
+  if (!(ds->flags & SSF_CHECK))
+    warning (0, "%s has no sector checksums -- checking readability only",
+             ds->fname);
+  else
+    {
+      if (ds->map_crc != ds->hdr_map_crc
+          || (ds->pos_map != NULL && ds->pos_crc != ds->hdr_pos_crc))
+        {
+          warning (1, "%s: The sector table is damaged", ds->fname);
+          ++problems;
+        }
+      if (size >= end)
+        {
+          check = xmalloc (ds->data_count * sizeof (crc_t));
+          rc = DosSetFilePtr (ds->hf, table_pos, FILE_BEGIN, &i);
+          if (rc == 0)
+            rc = DosRead (ds->hf, check, ds->data_count * sizeof (crc_t),
+                          &nread);
+          if (rc != 0)
+            error ("Cannot read %s (rc=%lu)", ds->fname, rc);
+          if (nread != ds->data_count * sizeof (crc_t)
+              || (crc_compute ((const unsigned char *)check,
+                               ds->data_count * sizeof (crc_t))
+                  != ds->hdr_check_crc))
+            {
+              warning (1, "%s: The checksum table is damaged", ds->fname);
+              ++problems;
+              free (check);
+              check = NULL;
+            }
+          else
+            for (i = 0; i < ds->data_count; ++i)
+              check[i] = ULONG_FROM_FS (check[i]);
+        }
+    }
 
-  if (isalpha ((unsigned char)avoid_fname[0]) && avoid_fname[1] == ':'
-      && avoid_fname[2] == 0)
+  /* Read the sectors.  The main thread does the first part of the
+     work. */
+
+  bad = xmalloc (ds->data_count + 1);
+  memset (bad, 0, ds->data_count + 1);
+  if (threads < 1)
+    threads = 1;
+  slice = DIVIDE_UP (ds->data_count, (ULONG)threads);
+  if (slice < VERIFY_CHUNK)
+    slice = VERIFY_CHUNK;
+  threads = (int)DIVIDE_UP (ds->data_count, slice);
+  jobs = xmalloc ((threads + 1) * sizeof (*jobs));
+  for (t = 0; t < threads; ++t)
     {
-      drive = fname_drive (save_fname);
-      if (drive == 0)
-        drive = cur_drive ();
-      if (toupper (drive) == toupper (avoid_fname[0]))
-        error ("The target file must not be on the source or target drive");
+      rc = DosOpen ((PCSZ)ds->fname, &jobs[t].hf, &action, 0, FILE_NORMAL,
+                    OPEN_ACTION_FAIL_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS,
+                    (OPEN_FLAGS_SEQUENTIAL | OPEN_FLAGS_NOINHERIT
+                     | OPEN_SHARE_DENYWRITE | OPEN_ACCESS_READONLY), 0);
+      if (rc != 0)
+        error ("Cannot open %s (rc=%lu)", ds->fname, rc);
+      jobs[t].first = 1 + t * slice;
+      jobs[t].count = MIN (slice, ds->data_count - t * slice);
+      jobs[t].check = check;
+      jobs[t].bad = bad;
+      jobs[t].buf = xmalloc (VERIFY_CHUNK * 512);
+      jobs[t].rc = 0;
+      if (t != 0)
+        {
+          rc = DosCreateThread (&jobs[t].tid, verify_thread, (ULONG)&jobs[t],
+                                CREATE_READY | STACK_SPARSE, 0x8000);
+          if (rc != 0)
+            error ("Cannot create thread (rc=%lu)", rc);
+        }
     }
-  save_file = fopen (save_fname, "wb");
-  if (save_file == NULL)
-    save_error ();
-  save_type = type;
-  switch (save_type)
+  if (threads > 0)
+    verify_thread ((ULONG)&jobs[0]);
+  for (t = 0; t < threads; ++t)
     {
-    case SAVE_SNAPSHOT:
-      save_sector_count = 0;
-      save_sector_alloc = 0;
-      save_sector_map = NULL;
-      memset (&hdr, 0, sizeof (hdr));
-      fwrite (&hdr, sizeof (hdr), 1, save_file);
-      break;
+      if (t != 0)
+        DosWaitThread (&jobs[t].tid, DCWW_WAIT);
+      DosClose (jobs[t].hf);
+      free (jobs[t].buf);
+      if (jobs[t].rc != 0)
+        warning (1, "Cannot read %s (rc=%lu)", ds->fname, jobs[t].rc);
+    }
+  free (jobs);
 
-    case SAVE_CRC:
-      save_sector_count = 0;
-      memset (&hdr, 0, sizeof (hdr));
-      fwrite (&hdr, sizeof (hdr), 1, save_file);
-      break;
+  /* Report the bad sectors. */
 
-    default:
-      break;
+  for (i = 0; i < n; ++i)
+    {
+      rel = (ds->pos_map != NULL ? ds->pos_map[i] : i + 1);
+      if (rel != 0 && rel <= ds->data_count && bad[rel-1])
+        {
+          warning (1, "%s: Sector #%lu is bad", ds->fname, ds->sector_map[i]);
+          ++problems;
+        }
     }
+  free (bad);
+  if (check != NULL)
+    free (check);
+
+  if (ds->base != NULL)
+    problems += diskio_snapshot_verify (ds->base, threads);
+  return problems;
 }
 
 
-/* Error while writing to the save file. */
+/* Read all CRCs of the leaf blocks of the CRC file associated with D
+   into memory, unless there is not enough memory.  This is used for
+   speeding up processing. */
 
-void save_error (void)
+void diskio_crc_load (DISKIO *d)
 {
-  error ("%s: %s", save_fname, strerror (errno));
-}
-
-
-/* Close the save file and update the header. */
+  ULONG n;
+
+  if (d->type != DIOT_CRC || d->x.crc.vec != NULL)
+    abort ();
+  n = d->x.crc.level_count[0];
+  if (n > (ULONG)-1 / sizeof (hash_t))
+    return;
+  d->x.crc.vec = malloc (n * sizeof (hash_t));
+  if (d->x.crc.vec == NULL)
+    return;
+  fseek (d->x.crc.f, d->x.crc.level_pos[0], SEEK_SET);
+  if (fread (d->x.crc.vec, d->x.crc.entry_size, n, d->x.crc.f) != n)
+    error ("Cannot read CRC file");
+  d->x.crc.next = d->total_sectors;
+  hash_from_fs (d->x.crc.vec, n, d->x.crc.hash);
+}
+
+
+/* Return the CRCs of the CRC file associated with D if they have been
+   read into memory by diskio_crc_load().  Otherwise, return NULL. */
+
+const hash_t *diskio_crc_vector (DISKIO *d)
+{
+  if (d->type != DIOT_CRC)
+    abort ();
+  return d->x.crc.vec;
+}
+
+
+/* Return the sector ranges of the sparse CRC file associated with D
+   and store the number of ranges to *PCOUNT.  Each range consists of
+   the first sector number and the number of sectors, the ranges are
+   sorted by sector number and don't overlap.  Return NULL if the CRC
+   file is not sparse. */
+
+const ULONG *diskio_crc_ranges (DISKIO *d, ULONG *pcount)
+{
+  if (d->type != DIOT_CRC)
+    abort ();
+  *pcount = d->x.crc.range_count;
+  return d->x.crc.ranges;
+}
+
+
+/* Return the hash algorithm (HASH_*) of the CRC file associated with
+   D. */
+
+int diskio_crc_hash (DISKIO *d)
+{
+  if (d->type != DIOT_CRC)
+    abort ();
+  return d->x.crc.hash;
+}
+
+
+/* Store the number of sectors per leaf block, the number of children
+   per tree node (0 if there is no tree), and the number of levels of
+   the CRC file associated with D to *PBLOCK, *PFANOUT, and
+   *PLEVELS. */
+
+void diskio_crc_geometry (DISKIO *d, ULONG *pblock, ULONG *pfanout,
+                          ULONG *plevels)
+{
+  if (d->type != DIOT_CRC)
+    abort ();
+  *pblock = d->x.crc.block_sectors;
+  *pfanout = d->x.crc.fanout;
+  *plevels = d->x.crc.levels;
+}
+
+
+/* Return the number of CRCs in level LEVEL of the CRC file associated
+   with D. */
+
+ULONG diskio_crc_level_count (DISKIO *d, ULONG level)
+{
+  if (d->type != DIOT_CRC || level >= d->x.crc.levels)
+    abort ();
+  return d->x.crc.level_count[level];
+}
+
+
+/* Read COUNT CRCs starting at index FIRST of level LEVEL of the CRC
+   file associated with D to DST. */
+
+void diskio_crc_read (DISKIO *d, ULONG level, ULONG first, ULONG count,
+                      hash_t *dst)
+{
+  if (d->type != DIOT_CRC || level >= d->x.crc.levels
+      || first + count > d->x.crc.level_count[level])
+    abort ();
+  if (level == 0 && d->x.crc.vec != NULL)
+    {
+      memcpy (dst, d->x.crc.vec + first, count * sizeof (hash_t));
+      return;
+    }
+  if (fseek (d->x.crc.f,
+             d->x.crc.level_pos[level] + first * d->x.crc.entry_size,
+             SEEK_SET) != 0
+      || fread (dst, d->x.crc.entry_size, count, d->x.crc.f) != count)
+    error ("Cannot read CRC file");
+  d->x.crc.next = (level == 0 && d->x.crc.block_sectors == 1
+                   ? first + count : d->total_sectors);
+  hash_from_fs (dst, count, d->x.crc.hash);
+}
+
+
+/* Store the index of the CRC of sector SECNO in the sparse CRC file
+   associated with D to *PIDX.  Return FALSE if the file does not
+   contain the CRC of that sector.  The range found is remembered as
+   the next one is usually the same or the following range. */
+
+static int crc_range_index (DISKIO *d, ULONG secno, ULONG *pidx)
+{
+  const ULONG *r;
+  ULONG lo, hi, mid;
+
+  r = d->x.crc.ranges;
+  lo = d->x.crc.range_cur;
+  if (lo < d->x.crc.range_count && secno >= r[2*lo]
+      && secno - r[2*lo] >= r[2*lo+1])
+    ++lo;
+  if (lo >= d->x.crc.range_count || secno < r[2*lo]
+      || secno - r[2*lo] >= r[2*lo+1])
+    {
+      /* Binary search for the last range starting at or before
+         SECNO. */
+
+      lo = 0; hi = d->x.crc.range_count;
+      while (hi - lo > 1)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (r[2*mid] <= secno)
+            lo = mid;
+          else
+            hi = mid;
+        }
+      if (hi == 0 || secno < r[2*lo] || secno - r[2*lo] >= r[2*lo+1])
+        return FALSE;
+    }
+  d->x.crc.range_cur = lo;
+  *pidx = d->x.crc.range_index[lo] + secno - r[2*lo];
+  return TRUE;
+}
+
+
+/* Compute the CRC of the sectors START through END-1 from the CRCs
+   of the CRC file associated with D, without accessing the disk.  On
+   success, store the CRC to *PCRC and return TRUE.  Return FALSE if
+   the CRC file does not contain the CRCs required: START and END must
+   be on block boundaries (END may also be the end of the disk), and
+   all the sectors must be present in a sparse CRC file.  The CRC file
+   must use HASH_CRC32. */
+
+int diskio_crc_range (DISKIO *d, ULONG start, ULONG end, crc_t *pcrc)
+{
+  hash_t buf[256];
+  ULONG block, first, last, b, i, n, len;
+  crc_t crc;
+
+  if (d->type != DIOT_CRC || d->x.crc.hash != HASH_CRC32)
+    abort ();
+  block = d->x.crc.block_sectors;
+  if (start > end || end > d->total_sectors || start % block != 0
+      || (end % block != 0 && end != d->total_sectors))
+    return FALSE;
+  if (start == end)
+    {
+      *pcrc = 0;
+      return TRUE;
+    }
+  if (d->x.crc.ranges != NULL)
+    {
+      /* The CRCs of the sectors of a range are stored consecutively.
+         The range is complete if the sector numbers and the indices
+         of the CRCs of the first and the last sector differ by the
+         same amount. */
+
+      if (!crc_range_index (d, start, &first)
+          || !crc_range_index (d, end - 1, &last)
+          || last - first != end - 1 - start)
+        return FALSE;
+    }
+  else
+    {
+      first = start / block;
+      last = (end - 1) / block;
+    }
+
+  /* Combine the CRCs of the blocks.  The last block of the disk may
+     be shorter (a sparse CRC file has one CRC per sector). */
+
+  crc = 0;
+  for (b = first; b <= last; b += n)
+    {
+      n = MIN (last - b + 1, 256);
+      diskio_crc_read (d, 0, b, n, buf);
+      for (i = 0; i < n; ++i)
+        {
+          len = MIN (block, d->total_sectors - (b + i) * block);
+          crc = crc_combine (crc, (crc_t)buf[i], len * 512);
+        }
+    }
+  *pcrc = crc;
+  return TRUE;
+}
+
+
+/* Return the index of sector N in the sector table of the snapshot
+   file associated with D.  Return HASH_END if there is no such
+   sector. */
+
+static ULONG snapshot_index (DISKIO *d, ULONG n)
+{
+  ULONG j;
+
+  for (j = d->x.snapshot.hash_start[n % HASH_SIZE]; j != HASH_END;
+       j = d->x.snapshot.hash_next[j])
+    if (d->x.snapshot.sector_map[j] == n)
+      return j;
+  return HASH_END;
+}
+
+
+/* Write the sector with number SEC and data SRC to the save file. */
+
+static void save_one_sec (const void *src, ULONG sec)
+{
+  ULONG i;
+  BYTE raw[512];
+
+  /* Ignore sectors which have already been saved.  Sectors saved in
+     ascending order (as by the `merge' action) cannot have been saved
+     before. */
+
+  if (save_sector_count == 0 || sec <= save_sector_max)
+    for (i = 0; i < save_sector_count; ++i)
+      if (save_sector_map[i] == sec)
+        return;
+  if (save_sector_count == 0 || sec > save_sector_max)
+    save_sector_max = sec;
+  if (save_sector_count >= save_sector_alloc)
+    {
+      save_sector_alloc += 1024;
+      save_sector_map = realloc (save_sector_map,
+                                 save_sector_alloc * sizeof (ULONG));
+      save_sector_pos = realloc (save_sector_pos,
+                                 save_sector_alloc * sizeof (ULONG));
+      save_sector_check = realloc (save_sector_check,
+                                   save_sector_alloc * sizeof (crc_t));
+      if (save_sector_map == NULL || save_sector_pos == NULL
+          || save_sector_check == NULL)
+        error ("Out of memory");
+    }
+
+  /* Don't write the sector if it is identical in the base snapshot
+     file. */
+
+  if (save_base != NULL && snapshot_index (save_base, sec) != HASH_END)
+    {
+      read_sec (save_base, raw, sec, 1, FALSE);
+      if (memcmp (raw, src, 512) == 0)
+        {
+          save_sector_pos[save_sector_count] = 0;
+          save_sector_map[save_sector_count++] = sec;
+          return;
+        }
+    }
+  save_sector_pos[save_sector_count] = ++save_data_count;
+  save_sector_map[save_sector_count++] = sec;
+  memcpy (raw, src, 512);
+
+  /* Scramble the signature so that there are no sectors with the
+     original HPFS sector signatures.  This simplifies recovering HPFS
+     file systems and undeleting files. */
+
+  *(ULONG *)raw ^= ULONG_TO_FS (SNAPSHOT_SCRAMBLE);
+  save_sector_check[save_data_count-1] = crc_compute (raw, 512);
+  if (fwrite (raw, 512, 1, save_file) != 1)
+    save_error ();
+}
+
+
+/* Write COUNT sectors starting at number SEC to the save file. */
+
+void save_sec (const void *src, ULONG sec, ULONG count)
+{
+  const char *p;
+
+  if (save_type == SAVE_MAP)
+    {
+      save_map_sectors (sec, count);
+      return;
+    }
+  if (save_type == SAVE_IMAGE)
+    {
+      /* Sectors beyond the end of the image are ignored.  Seek only
+         if the sectors don't follow the ones written last; the gaps
+         are not written. */
+
+      if (sec >= save_image_total)
+        return;
+      count = MIN (count, save_image_total - sec);
+      if (sec != save_image_next
+          && fseek (save_file, (long)sec * 512, SEEK_SET) != 0)
+        save_error ();
+      if (fwrite (src, 512, count, save_file) != count)
+        save_error ();
+      save_image_next = sec + count;
+      return;
+    }
+  p = (const char *)src;
+  while (count != 0)
+    {
+      save_one_sec (p, sec);
+      p += 512; ++sec; --count;
+    }
+}
+
+
+/* Start recording sector numbers (instead of writing sectors to a
+   save file) for a disk of TOTAL sectors.  save_sec() and
+   save_map_sectors() will record sectors, save_map_ranges() returns
+   the recorded sectors. */
+
+void save_map_create (ULONG total)
+{
+  save_type = SAVE_MAP;
+  save_map_total = total;
+  save_map = xmalloc (DIVIDE_UP (total, 8) + 1);
+  memset (save_map, 0, DIVIDE_UP (total, 8) + 1);
+}
+
+
+/* Record COUNT sectors starting at number SEC.  Sectors beyond the
+   end of the disk are ignored. */
+
+void save_map_sectors (ULONG sec, ULONG count)
+{
+  if (save_type != SAVE_MAP)
+    abort ();
+  if (sec >= save_map_total)
+    return;
+  count = MIN (count, save_map_total - sec);
+  while (count != 0 && (sec & 7) != 0)
+    {
+      save_map[sec/8] |= 1 << (sec & 7);
+      ++sec; --count;
+    }
+  if (count >= 8)
+    {
+      memset (save_map + sec / 8, 0xff, count / 8);
+      sec += count & ~7; count &= 7;
+    }
+  while (count != 0)
+    {
+      save_map[sec/8] |= 1 << (sec & 7);
+      ++sec; --count;
+    }
+}
+
+
+/* Stop recording sectors and return the ranges of sectors recorded
+   since save_map_create().  Store the number of ranges to *PCOUNT.
+   Each range consists of the first sector number and the number of
+   sectors.  The ranges are sorted by sector number.  The caller
+   should free the array. */
+
+ULONG *save_map_ranges (ULONG *pcount)
+{
+  ULONG *ranges;
+  ULONG i, start, n, alloc;
+
+  if (save_type != SAVE_MAP)
+    abort ();
+  n = 0; alloc = 256;
+  ranges = xmalloc (2 * alloc * sizeof (ULONG));
+  i = 0;
+  while (i < save_map_total)
+    {
+      /* Skip 32 or 8 sectors at a time. */
+
+      if ((i & 31) == 0 && i + 32 <= save_map_total
+          && ((const ULONG *)save_map)[i/32] == 0)
+        {
+          i += 32;
+          continue;
+        }
+      if ((i & 7) == 0 && save_map[i/8] == 0)
+        {
+          i += 8;
+          continue;
+        }
+      if (!BITSETP (save_map, i))
+        {
+          ++i;
+          continue;
+        }
+      start = i;
+      while (i < save_map_total)
+        if ((i & 31) == 0 && i + 32 <= save_map_total
+            && ((const ULONG *)save_map)[i/32] == 0xffffffff)
+          i += 32;
+        else if (BITSETP (save_map, i))
+          ++i;
+        else
+          break;
+      if (n >= alloc)
+        {
+          alloc *= 2;
+          ranges = realloc (ranges, 2 * alloc * sizeof (ULONG));
+          if (ranges == NULL)
+            error ("Out of memory");
+        }
+      ranges[2*n+0] = start;
+      ranges[2*n+1] = i - start;
+      ++n;
+    }
+  free (save_map);
+  save_map = NULL;
+  save_type = SAVE_RAW;
+  *pcount = n;
+  return ranges;
+}
+
+
+/* Complain if the file FNAME would be on the drive AVOID_FNAME. */
+
+static void check_file_drive (const char *fname, const char *avoid_fname)
+{
+  char drive;
+
+  if (isalpha ((unsigned char)avoid_fname[0]) && avoid_fname[1] == ':'
+      && avoid_fname[2] == 0)
+    {
+      drive = fname_drive (fname);
+      if (drive == 0)
+        drive = cur_drive ();
+      if (toupper (drive) == toupper (avoid_fname[0]))
+        error ("The target file must not be on the source or target drive");
+    }
+}
+
+
+/* Complain if the save file would be on the drive AVOID_FNAME. */
+
+static void save_check_drive (const char *avoid_fname)
+{
+  check_file_drive (save_fname, avoid_fname);
+}
+
+
+/* Create a save file of type TYPE.  The file name is passed in the
+   global variable `save_fname'.  Complain if the file would be on the
+   drive AVOID_FNAME.  A raw save file named "-" is standard output. */
+
+void save_create (const char *avoid_fname, enum save_type type)
+{
+  header hdr;
+
+  if (type == SAVE_RAW && strcmp (save_fname, "-") == 0)
+    {
+      save_file = stdout;
+      setmode (fileno (stdout), O_BINARY);
+    }
+  else
+    {
+      save_check_drive (avoid_fname);
+      save_file = fopen (save_fname, "wb");
+    }
+  if (save_file == NULL)
+    save_error ();
+  save_type = type;
+  switch (save_type)
+    {
+    case SAVE_SNAPSHOT:
+      save_sector_count = 0;
+      save_sector_alloc = 0;
+      save_sector_map = NULL;
+      save_sector_pos = NULL;
+      save_sector_check = NULL;
+      save_data_count = 0;
+      memset (&hdr, 0, sizeof (hdr));
+      fwrite (&hdr, sizeof (hdr), 1, save_file);
+      break;
+
+    case SAVE_CRC:
+      save_sector_count = 0;
+      save_crc_block = 0;
+      memset (&hdr, 0, sizeof (hdr));
+      fwrite (&hdr, sizeof (hdr), 1, save_file);
+      break;
+
+    default:
+      break;
+    }
+}
+
+
+/* Create the image file `save_fname' for a disk of TOTAL sectors.
+   Complain if the file would be on the drive AVOID_FNAME.  The file is
+   set to its final size at once; save_sec() writes sectors at their
+   positions.  Sectors not written are left as gaps, which take no
+   space if the file system supports sparse files, and read as zeros
+   otherwise. */
+
+void save_image_create (const char *avoid_fname, ULONG total)
+{
+  save_check_drive (avoid_fname);
+  if (total >= LONG_MAX / 512)
+    error ("Disk too big for an image file");
+  save_file = fopen (save_fname, "wb");
+  if (save_file == NULL)
+    save_error ();
+  if (chsize (fileno (save_file), (long)total * 512) != 0)
+    save_error ();
+  save_type = SAVE_IMAGE;
+  save_image_total = total;
+  save_image_next = 0;
+}
+
+
+/* Create the CRC file `save_fname' for a disk of TOTAL sectors or,
+   if RESUME is non-zero, continue an incomplete CRC file created for
+   that disk.  If BLOCK is zero, create a CRC file of version 1 (one
+   CRC per sector).  Otherwise, create a CRC file of version 2 with one
+   CRC per block of BLOCK sectors; save_close() will add the tree.  The
+   CRCs are computed with the hash algorithm ALG; BLOCK must not be
+   zero unless ALG is HASH_CRC32.  The CRCs are written by
+   save_crc_write() in chunks of CHUNK CRCs.  The magic number is
+   written by save_close(), therefore an incomplete CRC file has a zero
+   magic number.  Return the number of CRCs already present in the
+   file; the file is positioned after those CRCs. */
+
+ULONG save_crc_begin (const char *avoid_fname, ULONG total, ULONG block,
+                      int alg, ULONG chunk, int resume)
+{
+  header hdr;
+  FILE *f;
+  long size;
+  ULONG done;
+
+  save_check_drive (avoid_fname);
+  if (block == 0 && alg != HASH_CRC32)
+    abort ();
+  save_crc_hash = alg;
+  if (!resume)
+    {
+      /* Open for reading, too, for building the tree. */
+
+      save_file = fopen (save_fname, "w+b");
+      if (save_file == NULL)
+        save_error ();
+      save_type = SAVE_CRC;
+      save_sector_count = 0;
+      save_crc_block = block;
+      memset (&hdr, 0, sizeof (hdr));
+      hdr.c.sector_count = ULONG_TO_FS (total);
+      hdr.c.version = ULONG_TO_FS (block == 0 ? 1 : 2);
+      hdr.c.block_sectors = ULONG_TO_FS (block);
+      hdr.c.fanout = ULONG_TO_FS (block == 0 ? 0 : CRC_FANOUT);
+      hdr.c.hash = ULONG_TO_FS (alg);
+      if (fwrite (&hdr, sizeof (hdr), 1, save_file) != 1
+          || fflush (save_file) != 0)
+        save_error ();
+      return 0;
+    }
+
+  f = fopen (save_fname, "r+b");
+  if (f == NULL)
+    save_error ();
+  if (fread (&hdr, sizeof (hdr), 1, f) != 1)
+    error ("%s is not an incomplete CRC file", save_fname);
+  if (ULONG_FROM_FS (hdr.magic) == CRC_MAGIC)
+    error ("%s is already complete", save_fname);
+  if (hdr.magic != 0
+      || ULONG_FROM_FS (hdr.c.version) != (block == 0 ? 1 : 2)
+      || ULONG_FROM_FS (hdr.c.sector_count) != total
+      || ULONG_FROM_FS (hdr.c.hash) != (ULONG)alg
+      || (block != 0
+          && (ULONG_FROM_FS (hdr.c.block_sectors) != block
+              || ULONG_FROM_FS (hdr.c.fanout) != CRC_FANOUT)))
+    error ("%s is not an incomplete CRC file of this disk, block size, "
+           "and hash algorithm", save_fname);
+  if (fseek (f, 0L, SEEK_END) != 0 || (size = ftell (f)) < 512)
+    save_error ();
+
+  /* Only complete chunks are used. */
+
+  done = (ULONG)(size - 512) / crc_entry_size (alg);
+  done -= done % chunk;
+  if (done > DIVIDE_UP (total, (block == 0 ? 1 : block)))
+    done = DIVIDE_UP (total, (block == 0 ? 1 : block));
+  if (fseek (f, 512 + done * crc_entry_size (alg), SEEK_SET) != 0)
+    save_error ();
+  save_file = f;
+  save_type = SAVE_CRC;
+  save_sector_count = 0;
+  save_crc_block = block;
+  return done;
+}
+
+
+/* Create the sparse CRC file (version 3) `save_fname' for a disk of
+   TOTAL sectors.  The CRC file will contain the CRCs of the sectors
+   of the COUNT ranges of RANGES (see save_map_ranges()), one CRC per
+   sector, computed with the hash algorithm ALG.  The caller writes
+   the CRCs with save_crc_write().  Complain if the file would be on
+   the drive AVOID_FNAME. */
+
+void save_crc_sparse (const char *avoid_fname, ULONG total,
+                      const ULONG *ranges, ULONG count, int alg)
+{
+  header hdr;
+  ULONG i, r[2];
+
+  save_check_drive (avoid_fname);
+  save_file = fopen (save_fname, "wb");
+  if (save_file == NULL)
+    save_error ();
+  save_type = SAVE_CRC;
+  save_sector_count = 0;
+  save_crc_block = 0;
+  save_crc_is_sparse = TRUE;
+  save_crc_range_count = count;
+  save_crc_hash = alg;
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.c.sector_count = ULONG_TO_FS (total);
+  hdr.c.version = ULONG_TO_FS (3);
+  hdr.c.block_sectors = ULONG_TO_FS (1);
+  hdr.c.range_count = ULONG_TO_FS (count);
+  hdr.c.hash = ULONG_TO_FS (alg);
+  if (fwrite (&hdr, sizeof (hdr), 1, save_file) != 1)
+    save_error ();
+  for (i = 0; i < count; ++i)
+    {
+      r[0] = ULONG_TO_FS (ranges[2*i+0]);
+      r[1] = ULONG_TO_FS (ranges[2*i+1]);
+      if (fwrite (r, sizeof (ULONG), 2, save_file) != 2)
+        save_error ();
+    }
+}
+
+
+/* Write the sector map file `save_fname' for a disk of TOTAL
+   sectors.  The file contains the COUNT ranges of RANGES (see
+   save_map_ranges()), starting at offset 512.  Complain if the file
+   would be on one of the AVOID_COUNT drives AVOID_FNAMES. */
+
+void save_map_file (char *avoid_fnames[], int avoid_count, ULONG total,
+                    const ULONG *ranges, ULONG count)
+{
+  header hdr;
+  ULONG buf[2 * 256];
+  ULONG i, n;
+
+  for (i = 0; i < (ULONG)avoid_count; ++i)
+    save_check_drive (avoid_fnames[i]);
+  save_file = fopen (save_fname, "wb");
+  if (save_file == NULL)
+    save_error ();
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.m.magic = ULONG_TO_FS (MAP_MAGIC);
+  hdr.m.sector_count = ULONG_TO_FS (total);
+  hdr.m.version = ULONG_TO_FS (1);
+  hdr.m.range_count = ULONG_TO_FS (count);
+  if (fwrite (&hdr, sizeof (hdr), 1, save_file) != 1)
+    save_error ();
+  for (; count != 0; ranges += 2 * n, count -= n)
+    {
+      n = MIN (count, 256);
+      for (i = 0; i < 2 * n; ++i)
+        buf[i] = ULONG_TO_FS (ranges[i]);
+      if (fwrite (buf, 2 * sizeof (ULONG), n, save_file) != n)
+        save_error ();
+    }
+  if (fclose (save_file) != 0)
+    save_error ();
+  save_file = NULL;
+}
+
+
+/* Write the COUNT ranges of RANGES (see save_map_ranges()) to the
+   text file `save_fname', one range per line: the first sector
+   number and the number of sectors.  Complain if the file would be
+   on the drive AVOID_FNAME. */
+
+void save_map_text (const char *avoid_fname, const ULONG *ranges,
+                    ULONG count)
+{
+  ULONG i;
+
+  save_check_drive (avoid_fname);
+  save_file = fopen (save_fname, "w");
+  if (save_file == NULL)
+    save_error ();
+  for (i = 0; i < count; ++i)
+    if (fprintf (save_file, "%lu %lu\n", ranges[2*i+0], ranges[2*i+1]) < 0)
+      save_error ();
+  if (fclose (save_file) != 0)
+    save_error ();
+  save_file = NULL;
+}
+
+
+/* Build the tree of the CRC file being written, see
+   crc_tree_layout().  The leaves have already been written.  Return
+   the number of levels. */
+
+static ULONG save_crc_tree (void)
+{
+  ULONG pos[CRC_MAX_LEVELS], count[CRC_MAX_LEVELS];
+  ULONG levels, level, i, j, n, k, size;
+  BYTE *src, *dst;
+  hash_t h;
+
+  size = crc_entry_size (save_crc_hash);
+  levels = crc_tree_layout (save_sector_count, save_crc_block, CRC_FANOUT,
+                            size, pos, count);
+  src = xmalloc (CRC_FANOUT * 256 * size);
+  dst = xmalloc (256 * size);
+  for (level = 1; level < levels; ++level)
+    for (i = 0; i < count[level-1]; i += n)
+      {
+        /* Read the CRCs of up to 256 groups of the level below,
+           compute the CRCs of the groups. */
+
+        n = MIN (count[level-1] - i, CRC_FANOUT * 256);
+        if (fseek (save_file, pos[level-1] + i * size, SEEK_SET) != 0
+            || fread (src, size, n, save_file) != n)
+          save_error ();
+        for (j = 0; j * CRC_FANOUT < n; ++j)
+          {
+            k = MIN (n - j * CRC_FANOUT, CRC_FANOUT);
+            h = hash_compute (save_crc_hash, src + j * CRC_FANOUT * size,
+                              k * size);
+            hash_to_fs (dst + j * size, &h, 1, save_crc_hash);
+          }
+        if (fseek (save_file, pos[level] + (i / CRC_FANOUT) * size,
+                   SEEK_SET) != 0
+            || fwrite (dst, size, j, save_file) != j)
+          save_error ();
+      }
+  free (src);
+  free (dst);
+  return levels;
+}
+
+
+/* Write the COUNT CRCs at SRC to the CRC file being written, created
+   by save_crc_begin() or save_crc_sparse(). */
+
+void save_crc_write (const hash_t *src, ULONG count)
+{
+  BYTE buf[256 * 8];
+  ULONG n, size;
+
+  size = crc_entry_size (save_crc_hash);
+  for (; count != 0; src += n, count -= n)
+    {
+      n = MIN (count, 256);
+      hash_to_fs (buf, src, n, save_crc_hash);
+      if (fwrite (buf, size, n, save_file) != n)
+        save_error ();
+    }
+}
+
+
+/* Return true iff the save file can be continued after an
+   interruption, that is, if it is a CRC file created by
+   save_crc_begin(). */
+
+int save_resumable (void)
+{
+  return save_type == SAVE_CRC && !save_crc_is_sparse;
+}
+
+
+/* Error while writing to the save file. */
+
+void save_error (void)
+{
+  error ("%s: %s", save_fname, strerror (errno));
+}
+
+
+/* Store the name of the base snapshot file `save_base_fname' to DST
+   (SIZE bytes), for the delta snapshot file `save_fname'.  If both
+   files are in the same directory, store the name without directory,
+   which will be resolved relative to the directory of the delta
+   snapshot file.  Otherwise, store the full path name. */
+
+static void save_base_name (char *dst, size_t size)
+{
+  char base[260], delta[260];
+  size_t len;
+
+  if (_fullpath (base, save_base_fname, sizeof (base)) != 0
+      || _fullpath (delta, save_fname, sizeof (delta)) != 0)
+    error ("Cannot determine the full path name of %s", save_base_fname);
+  len = fname_dir_len (base);
+  if (len == fname_dir_len (delta) && strnicmp (base, delta, len) == 0)
+    memmove (base, base + len, strlen (base + len) + 1);
+  if (strlen (base) >= size)
+    error ("Name of base snapshot file too long");
+  strcpy (dst, base);
+}
+
+
+/* Close the save file and update the header. */
 
 void save_close (void)
 {
@@ -758,11 +2147,53 @@ void save_close (void)
       hdr.s.sector_count = ULONG_TO_FS (save_sector_count);
       hdr.s.map_pos = ULONG_TO_FS (ftell (save_file));
       hdr.s.version = ULONG_TO_FS (1); /* Scrambled */
+      hdr.s.flags = ULONG_TO_FS (SSF_CHECK);
       for (i = 0; i < save_sector_count; ++i)
         save_sector_map[i] = ULONG_TO_FS (save_sector_map[i]);
+      hdr.s.map_crc
+        = ULONG_TO_FS (crc_compute ((const unsigned char *)save_sector_map,
+                                    save_sector_count * sizeof (ULONG)));
       if (fwrite (save_sector_map, sizeof (ULONG), save_sector_count,
-                  save_file)
-          != save_sector_count || fseek (save_file, 0L, SEEK_SET) != 0)
+                  save_file) != save_sector_count)
+        save_error ();
+
+      /* A delta snapshot file additionally contains the relative
+         sector numbers and identifies its base snapshot file. */
+
+      if (save_base != NULL)
+        {
+          hdr.s.version = ULONG_TO_FS (2);
+          hdr.s.flags = ULONG_TO_FS (SSF_DELTA | SSF_CHECK);
+          hdr.s.base_sector_count
+            = ULONG_TO_FS (save_base->x.snapshot.sector_count);
+          hdr.s.base_map_crc = ULONG_TO_FS (save_base->x.snapshot.map_crc);
+          save_base_name (hdr.s.base_fname, sizeof (hdr.s.base_fname));
+          for (i = 0; i < save_sector_count; ++i)
+            save_sector_pos[i] = ULONG_TO_FS (save_sector_pos[i]);
+          hdr.s.pos_crc
+            = ULONG_TO_FS (crc_compute ((const unsigned char *)save_sector_pos,
+                                        save_sector_count * sizeof (ULONG)));
+          if (fwrite (save_sector_pos, sizeof (ULONG), save_sector_count,
+                      save_file) != save_sector_count)
+            save_error ();
+          for (i = 0; i < save_sector_count; ++i)
+            save_sector_pos[i] = ULONG_FROM_FS (save_sector_pos[i]);
+        }
+
+      /* The table of sector checksums follows.  It is ignored by
+         older versions of fst. */
+
+      for (i = 0; i < save_data_count; ++i)
+        save_sector_check[i] = ULONG_TO_FS (save_sector_check[i]);
+      hdr.s.check_crc
+        = ULONG_TO_FS (crc_compute ((const unsigned char *)save_sector_check,
+                                    save_data_count * sizeof (crc_t)));
+      if (fwrite (save_sector_check, sizeof (crc_t), save_data_count,
+                  save_file) != save_data_count)
+        save_error ();
+      for (i = 0; i < save_data_count; ++i)
+        save_sector_check[i] = ULONG_FROM_FS (save_sector_check[i]);
+      if (fseek (save_file, 0L, SEEK_SET) != 0)
         save_error ();
       fwrite (&hdr, sizeof (hdr), 1, save_file);
       for (i = 0; i < save_sector_count; ++i)
@@ -774,6 +2205,21 @@ void save_close (void)
       hdr.c.magic = ULONG_TO_FS (CRC_MAGIC);
       hdr.c.sector_count = ULONG_TO_FS (save_sector_count);
       hdr.c.version = ULONG_TO_FS (1);
+      hdr.c.hash = ULONG_TO_FS (save_crc_hash);
+      if (save_crc_is_sparse)
+        {
+          hdr.c.version = ULONG_TO_FS (3);
+          hdr.c.block_sectors = ULONG_TO_FS (1);
+          hdr.c.range_count = ULONG_TO_FS (save_crc_range_count);
+          save_crc_is_sparse = FALSE;
+        }
+      else if (save_crc_block != 0)
+        {
+          hdr.c.version = ULONG_TO_FS (2);
+          hdr.c.block_sectors = ULONG_TO_FS (save_crc_block);
+          hdr.c.fanout = ULONG_TO_FS (CRC_FANOUT);
+          hdr.c.levels = ULONG_TO_FS (save_crc_tree ());
+        }
       if (fseek (save_file, 0L, SEEK_SET) != 0)
         save_error ();
       fwrite (&hdr, sizeof (hdr), 1, save_file);
@@ -789,196 +2235,666 @@ void save_close (void)
 }
 
 
-/* Convert the logical sector number SECNO to cylinder numbe
-   (0-based), head number (0-based), and sector number (1-based).
-   Return TRUE iff successful. */
+/* Convert the logical sector number SECNO to cylinder numbe
+   (0-based), head number (0-based), and sector number (1-based).
+   Return TRUE iff successful. */
+
+int diskio_cyl_head_sec (DISKIO *d, cyl_head_sec *dst, ULONG secno)
+{
+  if (d->type != DIOT_DISK_TRACK)
+    return FALSE;
+
+  secno += d->x.track.hidden;
+  dst->sec = secno % d->x.track.spt + 1; secno /= d->x.track.spt;
+  dst->head = secno % d->x.track.heads; secno /= d->x.track.heads;
+  dst->cyl = secno;
+  return TRUE;
+}
+
+
+/* Return the relative sector number of sector N in the snapshot file
+   associated with D.  Return 0 if there is no such sector or if the
+   sector is stored in the base snapshot file of a delta snapshot file
+   (relative sector number 0 is the header of the snapshot file). */
+
+ULONG find_sec_in_snapshot (DISKIO *d, ULONG n)
+{
+  ULONG j;
+
+  j = snapshot_index (d, n);
+  if (j == HASH_END)
+    return 0;
+  else if (d->x.snapshot.pos_map != NULL)
+    return d->x.snapshot.pos_map[j];
+  else
+    return j + 1;
+}
+
+
+/* Seek to sector SEC in file HF. */
+
+static void seek_sec_hfile (HFILE hf, int sec_io, ULONG sec)
+{
+  ULONG rc, act_pos, n, rest;
+  LONG new_pos;
+
+  new_pos = (sec_io ? sec : sec * 512);
+  if (new_pos >= 0)
+    rc = DosSetFilePtr (hf, new_pos, FILE_BEGIN, &act_pos);
+  else
+    {
+      rc = DosSetFilePtr (hf, 0, FILE_BEGIN, &act_pos);
+      rest = sec;
+      while (rc == 0 && rest != 0)
+        {
+          n = MIN (rest, LONG_MAX / 512);
+          new_pos = n * 512;
+          rc = DosSetFilePtr (hf, new_pos, FILE_CURRENT, &act_pos);
+          rest -= n;
+        }
+    }
+  if (rc != 0)
+    error ("Cannot seek to sector #%lu (rc=%lu)", sec, rc);
+}
+
+
+/* Read COUNT sectors from HF. */
+
+static void read_sec_hfile (HFILE hf, int sec_io, void *dst,
+                            ULONG sec, ULONG count)
+{
+  ULONG rc, n, i;
+
+  i = (sec_io ? count : 512 * count);
+  seek_sec_hfile (hf, sec_io, sec);
+  rc = DosRead (hf, dst, i, &n);
+  if (rc != 0)
+    error ("Cannot read sector #%lu (rc=%lu)", sec, rc);
+  if (n != i)
+    error ("EOF reached while reading sector #%lu", sec);
+}
+
+
+/* Read up to COUNT sectors starting at sector SEC using
+   DSK_READTRACK, without crossing the end of the track.  PTL points to
+   the TRACKLAYOUT structure to use, BUF to a buffer for one track.
+   Store the number of sectors read to *PN.  Return the return code of
+   DosDevIOCtl.  This function is also used by threads, therefore it
+   must not use the C library. */
+
+static ULONG read_track_part (HFILE hf, const struct diskio_track *dt,
+                              TRACKLAYOUT *ptl, BYTE *buf, ULONG sec,
+                              ULONG count, ULONG *pn)
+{
+  ULONG parmlen, datalen, temp;
+
+  /* Note: Reading an entire track (dt->spt sectors) slows down
+     things even when caching one track, probably due to mapping done
+     by the hard disk controller. */
+
+  temp = sec + dt->hidden;
+  ptl->bCommand = 0x01;         /* Consecutive sectors */
+  ptl->usFirstSector = temp % dt->spt; temp /= dt->spt;
+  ptl->usHead = temp % dt->heads; temp /= dt->heads;
+  ptl->usCylinder = temp;
+  temp = dt->spt - ptl->usFirstSector;
+  if (temp > count)
+    temp = count;
+  ptl->cSectors = temp;
+  parmlen = dt->layout_size;
+  datalen = ptl->cSectors * 512;
+  *pn = temp;
+  return DosDevIOCtl (hf, IOCTL_DISK, DSK_READTRACK,
+                      ptl, parmlen, &parmlen,
+                      buf, datalen, &datalen);
+}
+
+
+/* Read COUNT sectors using DSK_READTRACK. */
+
+static void read_sec_track (HFILE hf, struct diskio_track *dt, void *dst,
+                            ULONG sec, ULONG count)
+{
+  ULONG rc, n;
+  char *p;
+
+  p = dst;
+  while (count != 0)
+    {
+      rc = read_track_part (hf, dt, dt->playout, dt->track_buf, sec, count,
+                            &n);
+      if (rc != 0)
+        error ("Cannot read sector #%lu (rc=%lu)", sec, rc);
+      memcpy (p, dt->track_buf, n * 512);
+      sec += n; p += n * 512; count -= n;
+    }
+}
+
+
+/* Read the COUNT sectors stored at relative sector POS and following
+   of the snapshot file associated with D to DST. */
+
+static void read_snapshot_data (DISKIO *d, void *dst, ULONG pos, ULONG count)
+{
+  ULONG k;
+
+  read_sec_hfile (d->x.snapshot.hf, FALSE, dst, pos, count);
+  if (d->x.snapshot.version >= 1)
+    for (k = 0; k < count; ++k)
+      *(ULONG *)((char *)dst + 512 * k) ^= ULONG_TO_FS (SNAPSHOT_SCRAMBLE);
+}
+
+
+/* Read COUNT sectors starting at sector SEC from the snapshot file
+   associated with D to DST.  Sectors stored at consecutive positions
+   of the snapshot file are read with a single call. */
+
+static void read_sec_snapshot (DISKIO *d, void *dst, ULONG sec, ULONG count)
+{
+  ULONG j, run;
+  char *p;
+
+  p = (char *)dst;
+  while (count != 0)
+    {
+      if (snapshot_index (d, sec) == HASH_END)
+        error ("Sector #%lu not found in snapshot file", sec);
+      j = find_sec_in_snapshot (d, sec);
+      if (j == 0)
+        {
+          read_sec (d->x.snapshot.base, p, sec, 1, FALSE);
+          run = 1;
+        }
+      else
+        {
+          run = 1;
+          while (run < count && find_sec_in_snapshot (d, sec + run) == j + run)
+            ++run;
+          read_snapshot_data (d, p, j, run);
+        }
+      p += 512 * run; sec += run; count -= run;
+    }
+}
+
+
+/* Read COUNT sectors from D to DST.  SEC is the starting sector
+   number.  Copy the sector to the save file if SAVE is non-zero. */
+
+void read_sec (DISKIO *d, void *dst, ULONG sec, ULONG count, int save)
+{
+  switch (d->type)
+    {
+    case DIOT_DISK_DASD:
+      read_sec_hfile (d->x.dasd.hf, d->x.dasd.sec_mode, dst, sec, count);
+      break;
+    case DIOT_DISK_TRACK:
+      read_sec_track (d->x.track.hf, &d->x.track, dst, sec, count);
+      break;
+    case DIOT_SNAPSHOT:
+      read_sec_snapshot (d, dst, sec, count);
+      break;
+    default:
+      abort ();
+    }
+  if (a_save && save)
+    save_sec (dst, sec, count);
+}
+
+
+/* Compare two entries of struct snapshot_pair by position in the
+   second snapshot file, for qsort(). */
+
+static int snapshot_pos2_comp (const void *x1, const void *x2)
+{
+  const struct snapshot_pair *p1 = (const struct snapshot_pair *)x1;
+  const struct snapshot_pair *p2 = (const struct snapshot_pair *)x2;
+  if (p1->pos2 < p2->pos2)
+    return -1;
+  else if (p1->pos2 > p2->pos2)
+    return 1;
+  else
+    return 0;
+}
+
+
+/* Read the data of the COUNT sectors of PAIRS from the snapshot file
+   D (WHICH is 1 or 2) to DST, in the order of PAIRS.  Sectors stored
+   at consecutive positions are read with a single call. */
+
+static void read_snapshot_pairs (DISKIO *d, int which,
+                                 const struct snapshot_pair *pairs,
+                                 ULONG count, BYTE *dst)
+{
+  ULONG i, pos, run;
+
+  for (i = 0; i < count; i += run)
+    {
+      pos = (which == 1 ? pairs[i].pos1 : pairs[i].pos2);
+      run = 1;
+      if (pos == 0)
+        read_sec (d, dst + i * 512, pairs[i].sec, 1, FALSE);
+      else
+        {
+          while (i + run < count
+                 && (which == 1 ? pairs[i+run].pos1
+                     : pairs[i+run].pos2) == pos + run)
+            ++run;
+          read_snapshot_data (d, dst + i * 512, pos, run);
+        }
+    }
+}
+
+
+/* Compare the sectors present in both snapshot files D1 and D2.
+   Return an array of the numbers of the differing sectors, sorted by
+   sector number, and store the number of entries to *PCOUNT.  The
+   caller should free the array.
+
+   The sectors are read in the order of their positions in the
+   snapshot files, not in the order of their sector numbers: D1 is
+   read sequentially, D2 is read in ascending order of positions
+   within batches of SNAPSHOT_CMP_BATCH sectors. */
+
+ULONG *diskio_snapshot_compare (DISKIO *d1, DISKIO *d2, ULONG *pcount)
+{
+  struct snapshot_pair *pairs;
+  BYTE *buf1, *buf2;
+  ULONG *result;
+  ULONG j, n, k, sec, count, alloc;
+
+  if (d1->type != DIOT_SNAPSHOT || d2->type != DIOT_SNAPSHOT)
+    abort ();
+  pairs = xmalloc (SNAPSHOT_CMP_BATCH * sizeof (*pairs));
+  buf1 = xmalloc (SNAPSHOT_CMP_BATCH * 512);
+  buf2 = xmalloc (SNAPSHOT_CMP_BATCH * 512);
+  count = 0; alloc = 256;
+  result = xmalloc (alloc * sizeof (ULONG));
+  j = 0;
+  while (j < d1->x.snapshot.sector_count)
+    {
+      /* Collect the next batch of sectors present in both files, in
+         the order of the first file. */
+
+      n = 0;
+      for (; j < d1->x.snapshot.sector_count && n < SNAPSHOT_CMP_BATCH; ++j)
+        {
+          sec = d1->x.snapshot.sector_map[j];
+          if (snapshot_index (d2, sec) == HASH_END)
+            continue;
+          pairs[n].sec = sec;
+          pairs[n].pos1 = (d1->x.snapshot.pos_map != NULL
+                           ? d1->x.snapshot.pos_map[j] : j + 1);
+          pairs[n].pos2 = find_sec_in_snapshot (d2, sec);
+          pairs[n].slot = n;
+          ++n;
+        }
+      read_snapshot_pairs (d1, 1, pairs, n, buf1);
+      qsort (pairs, n, sizeof (*pairs), snapshot_pos2_comp);
+      read_snapshot_pairs (d2, 2, pairs, n, buf2);
+      for (k = 0; k < n; ++k)
+        if (memcmp (buf1 + pairs[k].slot * 512, buf2 + k * 512, 512) != 0)
+          {
+            if (count >= alloc)
+              {
+                alloc *= 2;
+                result = realloc (result, alloc * sizeof (ULONG));
+                if (result == NULL)
+                  error ("Out of memory");
+              }
+            result[count++] = pairs[k].sec;
+          }
+    }
+  free (pairs);
+  free (buf1);
+  free (buf2);
+  qsort (result, count, sizeof (ULONG), snapshot_sort_comp);
+  *pcount = count;
+  return result;
+}
+
+
+/* Store the CRC of sector SECNO to the object pointed to by PCRC. */
 
-int diskio_cyl_head_sec (DISKIO *d, cyl_head_sec *dst, ULONG secno)
+int crc_sec (DISKIO *d, hash_t *pcrc, ULONG secno, int alg)
 {
-  if (d->type != DIOT_DISK_TRACK)
-    return FALSE;
+  ULONG idx;
 
-  secno += d->x.track.hidden;
-  dst->sec = secno % d->x.track.spt + 1; secno /= d->x.track.spt;
-  dst->head = secno % d->x.track.heads; secno /= d->x.track.heads;
-  dst->cyl = secno;
-  return TRUE;
+  if (d->type == DIOT_CRC)
+    {
+      if (d->x.crc.block_sectors != 1)
+        error ("The CRC file does not contain CRCs of single sectors");
+      if (secno >= d->total_sectors)
+        return FALSE;
+      idx = secno;
+      if (d->x.crc.ranges != NULL && !crc_range_index (d, secno, &idx))
+        return FALSE;
+      if (d->x.crc.vec != NULL)
+        {
+          *pcrc = d->x.crc.vec[idx];
+          return TRUE;
+        }
+      /* Avoid seeking when reading sequentially. */
+
+      if (idx != d->x.crc.next)
+        fseek (d->x.crc.f, d->x.crc.level_pos[0] + idx * d->x.crc.entry_size,
+               SEEK_SET);
+      if (fread (pcrc, d->x.crc.entry_size, 1, d->x.crc.f) != 1)
+        error ("CRC file: %s", strerror (errno));
+      d->x.crc.next = idx + 1;
+      hash_from_fs (pcrc, 1, d->x.crc.hash);
+      return TRUE;
+    }
+  else
+    {
+      BYTE data[512];
+
+      read_sec (d, data, secno, 1, FALSE);
+      *pcrc = hash_compute (alg, data, 512);
+      return TRUE;
+    }
 }
 
 
-/* Return the relative sector number of sector N in the snapshot file
-   associated with D.  Return 0 if there is no such sector (relative
-   sector number 0 is the header of the snapshot file). */
+/* Thread of diskio_crc_sectors().  ARG points to a struct crc_job.
+   This function must not use the C library. */
 
-ULONG find_sec_in_snapshot (DISKIO *d, ULONG n)
+static void APIENTRY crc_thread (ULONG arg)
 {
-  ULONG j;
-
-  for (j = d->x.snapshot.hash_start[n % HASH_SIZE]; j != HASH_END;
-       j = d->x.snapshot.hash_next[j])
-    if (d->x.snapshot.sector_map[j] == n)
-      return j + 1;
-  return 0;
+  struct crc_job *job;
+  ULONG rc, chunk, blocks, b, b_end, sec, end, n;
+  hash_state h;
+
+  job = (struct crc_job *)arg;
+  blocks = DIVIDE_UP (job->count, job->block);
+  for (chunk = job->first_chunk; chunk * job->chunk_blocks < blocks;
+       chunk += job->step)
+    {
+      b = chunk * job->chunk_blocks;
+      b_end = MIN (b + job->chunk_blocks, blocks);
+      for (; b < b_end; ++b)
+        {
+          sec = job->start + b * job->block;
+          end = job->start + MIN ((b + 1) * job->block, job->count);
+          hash_init (&h, job->alg);
+          while (sec < end)
+            {
+              rc = read_track_part (job->dt->hf, job->dt, job->playout,
+                                    job->track_buf, sec, end - sec, &n);
+              if (rc != 0)
+                {
+                  if (job->rc == 0 || sec < job->bad_sec)
+                    {
+                      job->rc = rc; job->bad_sec = sec;
+                    }
+                  return;
+                }
+              hash_update (&h, job->track_buf, n * 512);
+              sec += n;
+            }
+          job->dst[b] = hash_final (&h);
+        }
+    }
 }
 
 
-/* Seek to sector SEC in file HF. */
+/* Compute the CRCs of the COUNT sectors starting at sector START of
+   the disk D, one CRC per block of BLOCK sectors (the last block may
+   be shorter), and store them to DST.  The CRCs are computed with the
+   hash algorithm ALG.  For track I/O, the blocks are split into chunks
+   which are processed by THREADS threads. */
 
-static void seek_sec_hfile (HFILE hf, int sec_io, ULONG sec)
+void diskio_crc_sectors (DISKIO *d, hash_t *dst, ULONG start, ULONG count,
+                         ULONG block, int alg, int threads)
 {
-  ULONG rc, act_pos, n, rest;
-  LONG new_pos;
+  struct crc_job *jobs;
+  ULONG rc, i, sec, end, bad_sec, blocks, chunk_blocks;
+  hash_state h;
+  BYTE data[512];
+  int t;
 
-  new_pos = (sec_io ? sec : sec * 512);
-  if (new_pos >= 0)
-    rc = DosSetFilePtr (hf, new_pos, FILE_BEGIN, &act_pos);
-  else
+  blocks = DIVIDE_UP (count, block);
+  if (d->type != DIOT_DISK_TRACK)
     {
-      rc = DosSetFilePtr (hf, 0, FILE_BEGIN, &act_pos);
-      rest = sec;
-      while (rc == 0 && rest != 0)
+      for (i = 0; i < blocks; ++i)
         {
-          n = MIN (rest, LONG_MAX / 512);
-          new_pos = n * 512;
-          rc = DosSetFilePtr (hf, new_pos, FILE_CURRENT, &act_pos);
-          rest -= n;
+          hash_init (&h, alg);
+          end = start + MIN ((i + 1) * block, count);
+          for (sec = start + i * block; sec < end; ++sec)
+            {
+              read_sec (d, data, sec, 1, FALSE);
+              hash_update (&h, data, 512);
+            }
+          dst[i] = hash_final (&h);
+        }
+      return;
+    }
+
+  chunk_blocks = (block < CRC_CHUNK ? CRC_CHUNK / block : 1);
+  if (threads < 1)
+    threads = 1;
+  if ((ULONG)threads > DIVIDE_UP (blocks, chunk_blocks))
+    threads = (int)DIVIDE_UP (blocks, chunk_blocks);
+  jobs = xmalloc ((threads + 1) * sizeof (*jobs));
+  for (t = 0; t < threads; ++t)
+    {
+      jobs[t].dt = &d->x.track;
+      jobs[t].dst = dst;
+      jobs[t].start = start;
+      jobs[t].count = count;
+      jobs[t].block = block;
+      jobs[t].alg = alg;
+      jobs[t].chunk_blocks = chunk_blocks;
+      jobs[t].first_chunk = t;
+      jobs[t].step = threads;
+      jobs[t].playout = xmalloc (d->x.track.layout_size);
+      memcpy (jobs[t].playout, d->x.track.playout, d->x.track.layout_size);
+      jobs[t].track_buf = xmalloc (d->x.track.spt * 512);
+      jobs[t].rc = 0;
+      if (t != 0)
+        {
+          rc = DosCreateThread (&jobs[t].tid, crc_thread, (ULONG)&jobs[t],
+                                CREATE_READY | STACK_SPARSE, 0x8000);
+          if (rc != 0)
+            error ("Cannot create thread (rc=%lu)", rc);
+        }
+    }
+  if (threads > 0)
+    crc_thread ((ULONG)&jobs[0]);
+  rc = 0; bad_sec = 0;
+  for (t = 0; t < threads; ++t)
+    {
+      if (t != 0)
+        DosWaitThread (&jobs[t].tid, DCWW_WAIT);
+      free (jobs[t].playout);
+      free (jobs[t].track_buf);
+      if (jobs[t].rc != 0 && (rc == 0 || jobs[t].bad_sec < bad_sec))
+        {
+          rc = jobs[t].rc; bad_sec = jobs[t].bad_sec;
         }
     }
+  free (jobs);
   if (rc != 0)
-    error ("Cannot seek to sector #%lu (rc=%lu)", sec, rc);
+    error ("Cannot read sector #%lu (rc=%lu)", bad_sec, rc);
 }
 
 
-/* Read COUNT sectors from HF. */
+/* Compare the COUNT sectors at P1 to the COUNT sectors at P2.  Set
+   DIFF[I] to a non-zero value if sector I differs, to zero otherwise.
+   The words of a sector are combined four at a time without branches,
+   which lets the compiler vectorize the loop.  This function is also
+   used by threads, therefore it must not use the C library. */
 
-static void read_sec_hfile (HFILE hf, int sec_io, void *dst,
-                            ULONG sec, ULONG count)
+static void compare_sector_data (const BYTE *p1, const BYTE *p2, BYTE *diff,
+                                 ULONG count)
 {
-  ULONG rc, n, i;
+  const ULONG *w1, *w2;
+  ULONG i, j, x;
 
-  i = (sec_io ? count : 512 * count);
-  seek_sec_hfile (hf, sec_io, sec);
-  rc = DosRead (hf, dst, i, &n);
-  if (rc != 0)
-    error ("Cannot read sector #%lu (rc=%lu)", sec, rc);
-  if (n != i)
-    error ("EOF reached while reading sector #%lu", sec);
+  w1 = (const ULONG *)p1; w2 = (const ULONG *)p2;
+  for (i = 0; i < count; ++i)
+    {
+      x = 0;
+      for (j = 0; j < 512 / sizeof (ULONG); j += 4)
+        x |= ((w1[j+0] ^ w2[j+0]) | (w1[j+1] ^ w2[j+1])
+              | (w1[j+2] ^ w2[j+2]) | (w1[j+3] ^ w2[j+3]));
+      diff[i] = (x != 0);
+      w1 += 512 / sizeof (ULONG); w2 += 512 / sizeof (ULONG);
+    }
 }
 
 
-/* Read COUNT sectors using DSK_READTRACK. */
+/* Read COUNT sectors starting at sector SEC of the disk DT to BUF
+   using DSK_READTRACK.  PTL points to the TRACKLAYOUT structure to
+   use.  Return the return code of the first failing DosDevIOCtl and
+   store the number of the sector to *PBAD.  This function is also used
+   by threads, therefore it must not use the C library. */
 
-static void read_sec_track (HFILE hf, struct diskio_track *dt, void *dst,
-                            ULONG sec, ULONG count)
+static ULONG read_track_sectors (const struct diskio_track *dt,
+                                 TRACKLAYOUT *ptl, BYTE *buf, ULONG sec,
+                                 ULONG count, ULONG *pbad)
 {
-  ULONG rc, parmlen, datalen, temp;
-  TRACKLAYOUT *ptl;
-  char *p;
-
-  /* Note: Reading an entire track (dt->spt sectors) slows down
-     things even when caching one track, probably due to mapping done
-     by the hard disk controller. */
+  ULONG rc, n;
 
-  p = dst;
   while (count != 0)
     {
-      temp = sec + dt->hidden;
-      ptl = dt->playout;
-      ptl->bCommand = 0x01;     /* Consecutive sectors */
-      ptl->usFirstSector = temp % dt->spt; temp /= dt->spt;
-      ptl->usHead = temp % dt->heads; temp /= dt->heads;
-      ptl->usCylinder = temp;
-      temp = dt->spt - ptl->usFirstSector;
-      if (temp > count)
-        temp = count;
-      ptl->cSectors = temp;
-      parmlen = dt->layout_size;
-      datalen = ptl->cSectors * 512;
-      rc = DosDevIOCtl (hf, IOCTL_DISK, DSK_READTRACK,
-                        ptl, parmlen, &parmlen,
-                        dt->track_buf, datalen, &datalen);
+      rc = read_track_part (dt->hf, dt, ptl, buf, sec, count, &n);
       if (rc != 0)
-        error ("Cannot read sector #%lu (rc=%lu)", sec, rc);
-      memcpy (p, dt->track_buf, temp * 512);
-      sec += temp; p += temp * 512; count -= temp;
+        {
+          *pbad = sec;
+          return rc;
+        }
+      buf += n * 512; sec += n; count -= n;
     }
+  return 0;
 }
 
 
-/* Read COUNT sectors from D to DST.  SEC is the starting sector
-   number.  Copy the sector to the save file if SAVE is non-zero. */
+/* Thread of diskio_compare_sectors().  ARG points to a struct
+   cmp_job.  This function must not use the C library. */
 
-void read_sec (DISKIO *d, void *dst, ULONG sec, ULONG count, int save)
+static void APIENTRY cmp_thread (ULONG arg)
 {
-  ULONG i, j, n;
-  char *p;
+  struct cmp_job *job;
+  ULONG rc, chunk, sec, end, n, bad;
 
-  switch (d->type)
+  job = (struct cmp_job *)arg;
+  for (chunk = job->first_chunk; chunk * CMP_CHUNK < job->count;
+       chunk += job->step)
     {
-    case DIOT_DISK_DASD:
-      read_sec_hfile (d->x.dasd.hf, d->x.dasd.sec_mode, dst, sec, count);
-      break;
-    case DIOT_DISK_TRACK:
-      read_sec_track (d->x.track.hf, &d->x.track, dst, sec, count);
-      break;
-    case DIOT_SNAPSHOT:
-      p = (char *)dst; n = sec;
-      for (i = 0; i < count; ++i)
+      sec = chunk * CMP_CHUNK;
+      end = MIN (sec + CMP_CHUNK, job->count);
+      for (; sec < end; sec += n)
         {
-          j = find_sec_in_snapshot (d, n);
-          if (j == 0)
-            error ("Sector #%lu not found in snapshot file", n);
-          read_sec_hfile (d->x.snapshot.hf, FALSE, p, j, 1);
-          if (d->x.snapshot.version >= 1)
-            *(ULONG *)p ^= ULONG_TO_FS (SNAPSHOT_SCRAMBLE);
-          p += 512; ++n;
+          n = MIN (end - sec, CMP_PIECE);
+          rc = read_track_sectors (job->dt1, job->playout1, job->buf1,
+                                   job->start + sec, n, &bad);
+          if (rc == 0)
+            rc = read_track_sectors (job->dt2, job->playout2, job->buf2,
+                                     job->start + sec, n, &bad);
+          if (rc != 0)
+            {
+              if (job->rc == 0 || bad < job->bad_sec)
+                {
+                  job->rc = rc; job->bad_sec = bad;
+                }
+              return;
+            }
+          compare_sector_data (job->buf1, job->buf2, job->diff + sec, n);
         }
-      break;
-    default:
-      abort ();
     }
-  if (a_save && save)
-    save_sec (dst, sec, count);
 }
 
 
-/* Store the CRC of sector SECNO to the object pointed to by PCRC. */
+/* Compare the COUNT sectors starting at sector START of D1 and D2,
+   which are disks or snapshot files containing all these sectors.
+   Set DIFF[I] to a non-zero value if sector START+I differs, to zero
+   otherwise.  The sectors are read in large pieces.  If both D1 and
+   D2 use track I/O, the sectors are split into chunks which are
+   processed by THREADS threads. */
 
-int crc_sec (DISKIO *d, crc_t *pcrc, ULONG secno)
+void diskio_compare_sectors (DISKIO *d1, DISKIO *d2, ULONG start,
+                             ULONG count, BYTE *diff, int threads)
 {
-  if (d->type == DIOT_CRC)
+  struct cmp_job *jobs;
+  ULONG rc, sec, n, bad_sec;
+  BYTE *buf1, *buf2;
+  int t;
+
+  if (d1->type != DIOT_DISK_TRACK || d2->type != DIOT_DISK_TRACK)
     {
-      if (secno >= d->total_sectors)
-        return FALSE;
-      if (d->x.crc.vec != NULL)
+      buf1 = xmalloc (CMP_CHUNK * 512);
+      buf2 = xmalloc (CMP_CHUNK * 512);
+      for (sec = 0; sec < count; sec += n)
         {
-          *pcrc = d->x.crc.vec[secno];
-          return TRUE;
+          n = MIN (count - sec, CMP_CHUNK);
+          read_sec (d1, buf1, start + sec, n, FALSE);
+          read_sec (d2, buf2, start + sec, n, FALSE);
+          compare_sector_data (buf1, buf2, diff + sec, n);
         }
-      fseek (d->x.crc.f, 512 + secno * sizeof (crc_t), SEEK_SET);
-      if (fread (pcrc, sizeof (crc_t), 1, d->x.crc.f) != 1)
-        error ("CRC file: %s", strerror (errno));
-      *pcrc = ULONG_FROM_FS (*pcrc);
-      return TRUE;
+      free (buf1);
+      free (buf2);
+      return;
     }
-  else
-    {
-      BYTE data[512];
 
-      read_sec (d, data, secno, 1, FALSE);
-      *pcrc = crc_compute (data, 512);
-      return TRUE;
+  if (threads < 1)
+    threads = 1;
+  if ((ULONG)threads > DIVIDE_UP (count, CMP_CHUNK))
+    threads = (int)DIVIDE_UP (count, CMP_CHUNK);
+  jobs = xmalloc ((threads + 1) * sizeof (*jobs));
+  for (t = 0; t < threads; ++t)
+    {
+      jobs[t].dt1 = &d1->x.track;
+      jobs[t].dt2 = &d2->x.track;
+      jobs[t].diff = diff;
+      jobs[t].start = start;
+      jobs[t].count = count;
+      jobs[t].first_chunk = t;
+      jobs[t].step = threads;
+      jobs[t].playout1 = xmalloc (d1->x.track.layout_size);
+      memcpy (jobs[t].playout1, d1->x.track.playout, d1->x.track.layout_size);
+      jobs[t].playout2 = xmalloc (d2->x.track.layout_size);
+      memcpy (jobs[t].playout2, d2->x.track.playout, d2->x.track.layout_size);
+      jobs[t].buf1 = xmalloc (CMP_PIECE * 512);
+      jobs[t].buf2 = xmalloc (CMP_PIECE * 512);
+      jobs[t].rc = 0;
+      if (t != 0)
+        {
+          rc = DosCreateThread (&jobs[t].tid, cmp_thread, (ULONG)&jobs[t],
+                                CREATE_READY | STACK_SPARSE, 0x8000);
+          if (rc != 0)
+            error ("Cannot create thread (rc=%lu)", rc);
+        }
+    }
+  if (threads > 0)
+    cmp_thread ((ULONG)&jobs[0]);
+  rc = 0; bad_sec = 0;
+  for (t = 0; t < threads; ++t)
+    {
+      if (t != 0)
+        DosWaitThread (&jobs[t].tid, DCWW_WAIT);
+      free (jobs[t].playout1);
+      free (jobs[t].playout2);
+      free (jobs[t].buf1);
+      free (jobs[t].buf2);
+      if (jobs[t].rc != 0 && (rc == 0 || jobs[t].bad_sec < bad_sec))
+        {
+          rc = jobs[t].rc; bad_sec = jobs[t].bad_sec;
+        }
     }
+  free (jobs);
+  if (rc != 0)
+    error ("Cannot read sector #%lu (rc=%lu)", bad_sec, rc);
 }
 
 
-/* Write sector SEC to HF. */
+/* Write COUNT sectors starting at sector SEC to HF. */
 
-static int write_sec_hfile (HFILE hf, int sec_io, const void *src, ULONG sec)
+static int write_sec_hfile (HFILE hf, int sec_io, const void *src, ULONG sec,
+                            ULONG count)
 {
   ULONG rc, n, i;
 
-  i = (sec_io ? 1 : 512);
+  i = (sec_io ? count : count * 512);
   seek_sec_hfile (hf, sec_io, sec);
   rc = DosWrite (hf, src, i, &n);
   if (rc != 0)
@@ -1043,10 +2959,15 @@ static int write_sec_snapshot (DISKIO *d, const void *src, ULONG sec)
   BYTE raw[512];
   ULONG j;
 
+  if (snapshot_index (d, sec) == HASH_END)
+    {
+      warning (1, "Sector #%lu not found in snapshot file", sec);
+      return FALSE;
+    }
   j = find_sec_in_snapshot (d, sec);
   if (j == 0)
     {
-      warning (1, "Sector #%lu not found in snapshot file", sec);
+      warning (1, "Sector #%lu is in the base snapshot file", sec);
       return FALSE;
     }
 
@@ -1057,24 +2978,335 @@ static int write_sec_snapshot (DISKIO *d, const void *src, ULONG sec)
   if (d->x.snapshot.version >= 1)
     *(ULONG *)raw ^= ULONG_TO_FS (SNAPSHOT_SCRAMBLE);
 
-  return write_sec_hfile (d->x.snapshot.hf, FALSE, raw, j);
+  return write_sec_hfile (d->x.snapshot.hf, FALSE, raw, j, 1);
 }
 
 
-/* Write sector SRC to D. */
+/* Write COUNT sectors starting at sector SEC from SRC to D.  Disks
+   are written with a single call (or one call per track).  Return
+   FALSE on failure. */
 
-int write_sec (DISKIO *d, const void *src, ULONG sec)
+int write_sec (DISKIO *d, const void *src, ULONG sec, ULONG count)
 {
+  ULONG k;
+  int ok;
+
   switch (d->type)
     {
     case DIOT_DISK_DASD:
-      return write_sec_hfile (d->x.dasd.hf, d->x.dasd.sec_mode, src, sec);
+      return write_sec_hfile (d->x.dasd.hf, d->x.dasd.sec_mode, src, sec,
+                              count);
     case DIOT_DISK_TRACK:
-      return write_sec_track (d->x.track.hf, &d->x.track, src, sec, 1);
+      return write_sec_track (d->x.track.hf, &d->x.track, src, sec, count);
     case DIOT_SNAPSHOT:
-      return write_sec_snapshot (d, src, sec);
+      ok = TRUE;
+      for (k = 0; k < count; ++k)
+        if (!write_sec_snapshot (d, (const char *)src + 512 * k, sec + k))
+          ok = FALSE;
+      return ok;
     default:
       abort ();
     }
   return FALSE;
 }
+
+/* The undo journal of the `restore' action starts with a header (see
+   `header') which is followed by one record per batch of sectors
+   written.  A record consists of a record header of 512 bytes and the
+   old contents of the sectors of the batch.  The record is written
+   and flushed to the disk before the sectors of the batch are
+   overwritten; after writing the sectors, the record is marked as
+   done. */
+
+#define JOURNAL_REC_MAGIC       0xa3d86f16
+
+/* Maximum number of sectors of a batch. */
+
+#define JOURNAL_MAX_BATCH       1024
+
+typedef union
+{
+  BYTE raw[512];                /* Force the header size to 512 bytes */
+  struct
+    {
+      ULONG magic;              /* JOURNAL_REC_MAGIC */
+      ULONG batch;              /* Batch number, starting at 0 */
+      ULONG idx;                /* Index of the first sector in the list */
+      ULONG sec;                /* First sector number */
+      ULONG count;              /* Number of sectors */
+      ULONG done;               /* Non-zero if the sectors have been written */
+      ULONG data_crc;           /* CRC of the old contents */
+    } r;
+} journal_record;
+
+static HFILE journal_hf;        /* Handle of the journal */
+static const char *journal_fname; /* Name of the journal */
+static header journal_hdr;      /* Header of the journal */
+static journal_record journal_rec; /* Header of the last record */
+static ULONG journal_batch;     /* Number of records */
+static ULONG journal_last;      /* Position of the last record */
+static ULONG journal_end;       /* Position after the last record */
+static ULONG *journal_pos;      /* Positions of all records (for undo) */
+
+
+/* Write SIZE bytes at SRC to the journal at position POS. */
+
+static void journal_write (ULONG pos, const void *src, ULONG size)
+{
+  ULONG rc, n;
+
+  rc = DosSetFilePtr (journal_hf, pos, FILE_BEGIN, &n);
+  if (rc == 0)
+    rc = DosWrite (journal_hf, src, size, &n);
+  if (rc != 0)
+    error ("Cannot write %s (rc=%lu)", journal_fname, rc);
+  if (n != size)
+    error ("Incomplete write for %s", journal_fname);
+}
+
+
+/* Read SIZE bytes at position POS of the journal to DST.  Return
+   FALSE if the journal ends before. */
+
+static int journal_read (ULONG pos, void *dst, ULONG size)
+{
+  ULONG rc, n;
+
+  rc = DosSetFilePtr (journal_hf, pos, FILE_BEGIN, &n);
+  if (rc == 0)
+    rc = DosRead (journal_hf, dst, size, &n);
+  if (rc != 0)
+    error ("Cannot read %s (rc=%lu)", journal_fname, rc);
+  return n == size;
+}
+
+
+/* Flush the journal to the disk. */
+
+static void journal_sync (void)
+{
+  ULONG rc;
+
+  rc = DosResetBuffer (journal_hf);
+  if (rc != 0)
+    error ("Cannot write %s (rc=%lu)", journal_fname, rc);
+}
+
+
+/* Open the journal FNAME.  Create it if CREATE is true.  Complain if
+   the journal would be on the drive AVOID_FNAME. */
+
+static void journal_open (const char *fname, const char *avoid_fname,
+                          int create)
+{
+  ULONG rc, action;
+
+  check_file_drive (fname, avoid_fname);
+  journal_fname = fname;
+  rc = DosOpen ((PCSZ)fname, &journal_hf, &action, 0, FILE_NORMAL,
+                (create
+                 ? OPEN_ACTION_CREATE_IF_NEW | OPEN_ACTION_REPLACE_IF_EXISTS
+                 : OPEN_ACTION_FAIL_IF_NEW | OPEN_ACTION_OPEN_IF_EXISTS),
+                (OPEN_FLAGS_FAIL_ON_ERROR | OPEN_FLAGS_NOINHERIT
+                 | OPEN_SHARE_DENYWRITE | OPEN_ACCESS_READWRITE), 0);
+  if (rc != 0)
+    error ("Cannot open %s (rc=%lu)", fname, rc);
+}
+
+
+/* Read the header of the journal and all complete records.  An
+   incomplete or damaged record (and everything following it) is
+   ignored: the sectors of that batch have not been written. */
+
+static void journal_scan (void)
+{
+  BYTE *buf;
+  ULONG count, alloc;
+
+  if (!journal_read (0, &journal_hdr, sizeof (journal_hdr))
+      || ULONG_FROM_FS (journal_hdr.j.magic) != JOURNAL_MAGIC)
+    error ("%s is not a restore journal", journal_fname);
+  if (ULONG_FROM_FS (journal_hdr.j.version) != 1)
+    error ("Format of %s not supported", journal_fname);
+  journal_batch = 0; alloc = 0; journal_pos = NULL;
+  journal_end = sizeof (journal_hdr);
+  buf = xmalloc (JOURNAL_MAX_BATCH * 512);
+  for (;;)
+    {
+      if (!journal_read (journal_end, &journal_rec, sizeof (journal_rec))
+          || ULONG_FROM_FS (journal_rec.r.magic) != JOURNAL_REC_MAGIC
+          || ULONG_FROM_FS (journal_rec.r.batch) != journal_batch)
+        break;
+      count = ULONG_FROM_FS (journal_rec.r.count);
+      if (count == 0 || count > JOURNAL_MAX_BATCH)
+        break;
+      if (!journal_read (journal_end + sizeof (journal_rec), buf, count * 512)
+          || (crc_compute (buf, count * 512)
+              != ULONG_FROM_FS (journal_rec.r.data_crc)))
+        break;
+      if (journal_batch >= alloc)
+        {
+          alloc += 256;
+          journal_pos = realloc (journal_pos, alloc * sizeof (ULONG));
+          if (journal_pos == NULL)
+            error ("Out of memory");
+        }
+      journal_pos[journal_batch++] = journal_end;
+      journal_last = journal_end;
+      journal_end += sizeof (journal_rec) + count * 512;
+    }
+  free (buf);
+  if (journal_batch != 0)
+    journal_read (journal_last, &journal_rec, sizeof (journal_rec));
+}
+
+
+/* Create the journal FNAME for restoring COUNT sectors.  MAP_CRC is
+   the CRC of the list of sectors.  Complain if the journal would be
+   on the drive AVOID_FNAME. */
+
+void journal_create (const char *fname, const char *avoid_fname,
+                     ULONG count, ULONG map_crc)
+{
+  journal_open (fname, avoid_fname, TRUE);
+  memset (&journal_hdr, 0, sizeof (journal_hdr));
+  journal_hdr.j.magic = ULONG_TO_FS (JOURNAL_MAGIC);
+  journal_hdr.j.sector_count = ULONG_TO_FS (count);
+  journal_hdr.j.version = ULONG_TO_FS (1);
+  journal_hdr.j.state = ULONG_TO_FS (JOURNAL_ACTIVE);
+  journal_hdr.j.map_crc = ULONG_TO_FS (map_crc);
+  journal_write (0, &journal_hdr, sizeof (journal_hdr));
+  journal_sync ();
+  journal_batch = 0; journal_pos = NULL;
+  journal_end = sizeof (journal_hdr);
+}
+
+
+/* Continue the interrupted restore operation recorded in the journal
+   FNAME.  COUNT and MAP_CRC must match the values passed to
+   journal_create().  Return the index (into the list of sectors) at
+   which to continue.  If the last batch has not been completed, set
+   *PPENDING to true; that batch is to be written again without
+   calling journal_begin(), but journal_done() must be called. */
+
+ULONG journal_resume (const char *fname, const char *avoid_fname,
+                      ULONG count, ULONG map_crc, int *ppending)
+{
+  ULONG rc;
+
+  journal_open (fname, avoid_fname, FALSE);
+  journal_scan ();
+  switch (ULONG_FROM_FS (journal_hdr.j.state))
+    {
+    case JOURNAL_COMPLETE:
+      error ("The restore operation recorded in %s is already complete",
+             fname);
+    case JOURNAL_UNDONE:
+      error ("The restore operation recorded in %s has been undone", fname);
+    default:
+      break;
+    }
+  if (ULONG_FROM_FS (journal_hdr.j.sector_count) != count
+      || ULONG_FROM_FS (journal_hdr.j.map_crc) != map_crc)
+    error ("%s does not belong to this restore operation", fname);
+  rc = DosSetFileSize (journal_hf, journal_end);
+  if (rc != 0)
+    error ("Cannot write %s (rc=%lu)", fname, rc);
+  free (journal_pos); journal_pos = NULL;
+  *ppending = FALSE;
+  if (journal_batch == 0)
+    return 0;
+  if (journal_rec.r.done == 0)
+    {
+      *ppending = TRUE;
+      return ULONG_FROM_FS (journal_rec.r.idx);
+    }
+  return (ULONG_FROM_FS (journal_rec.r.idx)
+          + ULONG_FROM_FS (journal_rec.r.count));
+}
+
+
+/* Record the old contents OLD of the COUNT sectors starting at sector
+   SEC before overwriting them.  IDX is the index of sector SEC in the
+   list of sectors.  The record is flushed to the disk before
+   returning. */
+
+void journal_begin (ULONG idx, ULONG sec, ULONG count, const void *old)
+{
+  if (count > JOURNAL_MAX_BATCH)
+    abort ();
+  memset (&journal_rec, 0, sizeof (journal_rec));
+  journal_rec.r.magic = ULONG_TO_FS (JOURNAL_REC_MAGIC);
+  journal_rec.r.batch = ULONG_TO_FS (journal_batch);
+  journal_rec.r.idx = ULONG_TO_FS (idx);
+  journal_rec.r.sec = ULONG_TO_FS (sec);
+  journal_rec.r.count = ULONG_TO_FS (count);
+  journal_rec.r.data_crc = ULONG_TO_FS (crc_compute (old, count * 512));
+  journal_write (journal_end + sizeof (journal_rec), old, count * 512);
+  journal_write (journal_end, &journal_rec, sizeof (journal_rec));
+  journal_sync ();
+  journal_last = journal_end;
+  journal_end += sizeof (journal_rec) + count * 512;
+  ++journal_batch;
+}
+
+
+/* Mark the last batch as written.  This is not flushed immediately:
+   if the mark gets lost, the batch will just be written again by
+   `restore -resume'. */
+
+void journal_done (void)
+{
+  journal_rec.r.done = ULONG_TO_FS (1);
+  journal_write (journal_last, &journal_rec, sizeof (journal_rec));
+}
+
+
+/* Close the journal.  If COMPLETE is true, all sectors have been
+   written. */
+
+void journal_close (int complete)
+{
+  if (complete)
+    {
+      journal_hdr.j.state = ULONG_TO_FS (JOURNAL_COMPLETE);
+      journal_write (0, &journal_hdr, sizeof (journal_hdr));
+    }
+  journal_sync ();
+  DosClose (journal_hf);
+}
+
+
+/* Undo the restore operation recorded in the journal FNAME by writing
+   the old contents of all batches back to D, last batch first.
+   Complain if the journal would be on the drive AVOID_FNAME.  Return
+   the number of sectors which could not be written. */
+
+ULONG journal_undo (const char *fname, const char *avoid_fname, DISKIO *d)
+{
+  BYTE *buf;
+  ULONG i, count, bad;
+
+  journal_open (fname, avoid_fname, FALSE);
+  journal_scan ();
+  if (ULONG_FROM_FS (journal_hdr.j.state) == JOURNAL_UNDONE)
+    error ("The restore operation recorded in %s has already been undone",
+           fname);
+  buf = xmalloc (JOURNAL_MAX_BATCH * 512);
+  bad = 0; i = journal_batch;
+  while (i != 0)
+    {
+      --i;
+      journal_read (journal_pos[i], &journal_rec, sizeof (journal_rec));
+      count = ULONG_FROM_FS (journal_rec.r.count);
+      journal_read (journal_pos[i] + sizeof (journal_rec), buf, count * 512);
+      if (!write_sec (d, buf, ULONG_FROM_FS (journal_rec.r.sec), count))
+        bad += count;
+    }
+  free (buf); free (journal_pos); journal_pos = NULL;
+  journal_hdr.j.state = ULONG_TO_FS (JOURNAL_UNDONE);
+  journal_write (0, &journal_hdr, sizeof (journal_hdr));
+  journal_sync ();
+  DosClose (journal_hf);
+  return bad;
+}
@@ -37,7 +37,9 @@ enum save_type
 {
   SAVE_RAW,
   SAVE_SNAPSHOT,
-  SAVE_CRC
+  SAVE_CRC,
+  SAVE_MAP,                     /* Bitmap of sectors, no file */
+  SAVE_IMAGE                    /* Raw image of the disk */
 };
 
 /* Method for accessing the disk. */
@@ -52,13 +54,36 @@ enum access_type
 
 #define CRC_MAGIC               0xac994df4
 #define SNAPSHOT_MAGIC          0xaf974803
+#define MAP_MAGIC               0xa9e31c57
+#define JOURNAL_MAGIC           0xa3d86f15
+
+/* States of a restore journal. */
+
+#define JOURNAL_ACTIVE          0       /* Restore in progress */
+#define JOURNAL_COMPLETE        1       /* All sectors written */
+#define JOURNAL_UNDONE          2       /* Old contents written back */
 
 /* XOR the first 32-bit word of a save file with this value. */
 
 #define SNAPSHOT_SCRAMBLE       0x551234af
 
+/* Bits for the `flags' field of the header of a snapshot file.
+   SSF_DELTA requires version 2. */
+
+#define SSF_DELTA               0x0001  /* Delta against a base snapshot */
+#define SSF_CHECK               0x0002  /* Sector checksums present */
+
 
-/* This header is used for snapshot files and CRC files. */
+/* Number of children of a node of the CRC tree of a CRC file (version
+   2) created by fst, and limits for reading CRC files.  A sparse CRC
+   file (version 3) has no tree. */
+
+#define CRC_FANOUT              64
+#define CRC_MAX_FANOUT          256
+#define CRC_MAX_LEVELS          32
+
+/* This header is used for snapshot files, CRC files, sector map
+   files, and restore journals. */
 
 typedef union
 {
@@ -70,13 +95,40 @@ typedef union
       ULONG sector_count;       /* Number of sectors in the snapshot */
       ULONG map_pos;            /* Relative byte address of the sector table */
       ULONG version;            /* Format version number */
+      ULONG flags;              /* SSF_* flags */
+      ULONG base_sector_count;  /* Number of sectors in the base snapshot */
+      ULONG base_map_crc;       /* CRC of the sector table of the base */
+      char base_fname[260];     /* Name of the base snapshot file */
+      ULONG map_crc;            /* CRC of the sector table (SSF_CHECK) */
+      ULONG pos_crc;            /* CRC of the position table (SSF_CHECK) */
+      ULONG check_crc;          /* CRC of the checksum table (SSF_CHECK) */
     } s;                        /* Header for snapshot file */
   struct
     {
       ULONG magic;              /* Magic number */
       ULONG sector_count;       /* Number of sectors (CRCs) in the snapshot */
       ULONG version;            /* Format version number */
+      ULONG block_sectors;      /* Sectors per leaf block (version 2) */
+      ULONG fanout;             /* Children per tree node (version 2) */
+      ULONG levels;             /* Number of levels of the tree (version 2) */
+      ULONG range_count;        /* Number of sector ranges (version 3) */
+      ULONG hash;               /* Hash algorithm (HASH_*) */
     } c;                        /* Header for CRC file */
+  struct
+    {
+      ULONG magic;              /* Magic number */
+      ULONG sector_count;       /* Number of sectors of the disk */
+      ULONG version;            /* Format version number */
+      ULONG range_count;        /* Number of sector ranges */
+    } m;                        /* Header for sector map file */
+  struct
+    {
+      ULONG magic;              /* Magic number */
+      ULONG sector_count;       /* Number of sectors to be restored */
+      ULONG version;            /* Format version number */
+      ULONG state;              /* JOURNAL_* */
+      ULONG map_crc;            /* CRC of the list of sectors */
+    } j;                        /* Header for restore journal */
 } header;
 
 typedef struct
@@ -99,6 +151,8 @@ extern const char *save_fname;
 extern ULONG save_sector_count;
 extern ULONG save_sector_alloc;
 extern ULONG *save_sector_map;
+extern DISKIO *save_base;
+extern const char *save_base_fname;
 
 
 /* See diskio.c */
@@ -108,13 +162,50 @@ unsigned diskio_type (DISKIO *d);
 ULONG diskio_total_sectors (DISKIO *d);
 ULONG diskio_snapshot_sectors (DISKIO *d);
 ULONG *diskio_snapshot_sort (DISKIO *d);
+ULONG *diskio_snapshot_compare (DISKIO *d1, DISKIO *d2, ULONG *pcount);
+ULONG diskio_snapshot_verify (DISKIO *d, int threads);
 void diskio_crc_load (DISKIO *d);
+const hash_t *diskio_crc_vector (DISKIO *d);
+int diskio_crc_hash (DISKIO *d);
+const ULONG *diskio_crc_ranges (DISKIO *d, ULONG *pcount);
 int diskio_cyl_head_sec (DISKIO *d, cyl_head_sec *dst, ULONG secno);
 void save_sec (const void *src, ULONG sec, ULONG count);
 void save_create (const char *avoid_fname, enum save_type type);
+ULONG save_crc_begin (const char *avoid_fname, ULONG total, ULONG block,
+                      int alg, ULONG chunk, int resume);
+void save_crc_sparse (const char *avoid_fname, ULONG total,
+                      const ULONG *ranges, ULONG count, int alg);
+void save_crc_write (const hash_t *src, ULONG count);
+void save_map_create (ULONG total);
+void save_image_create (const char *avoid_fname, ULONG total);
+void save_map_sectors (ULONG sec, ULONG count);
+ULONG *save_map_ranges (ULONG *pcount);
+void save_map_file (char *avoid_fnames[], int avoid_count, ULONG total,
+                    const ULONG *ranges, ULONG count);
+void save_map_text (const char *avoid_fname, const ULONG *ranges,
+                    ULONG count);
+int save_resumable (void);
 void save_error (void);
 void save_close (void);
 ULONG find_sec_in_snapshot (DISKIO *d, ULONG n);
 void read_sec (DISKIO *d, void *dst, ULONG sec, ULONG count, int save);
-int crc_sec (DISKIO *d, crc_t *pcrc, ULONG secno);
-int write_sec (DISKIO *d, const void *src, ULONG sec);
+int crc_sec (DISKIO *d, hash_t *pcrc, ULONG secno, int alg);
+void diskio_crc_sectors (DISKIO *d, hash_t *dst, ULONG start, ULONG count,
+                         ULONG block, int alg, int threads);
+void diskio_compare_sectors (DISKIO *d1, DISKIO *d2, ULONG start,
+                             ULONG count, BYTE *diff, int threads);
+void diskio_crc_geometry (DISKIO *d, ULONG *pblock, ULONG *pfanout,
+                          ULONG *plevels);
+ULONG diskio_crc_level_count (DISKIO *d, ULONG level);
+void diskio_crc_read (DISKIO *d, ULONG level, ULONG first, ULONG count,
+                      hash_t *dst);
+int diskio_crc_range (DISKIO *d, ULONG start, ULONG end, crc_t *pcrc);
+int write_sec (DISKIO *d, const void *src, ULONG sec, ULONG count);
+void journal_create (const char *fname, const char *avoid_fname,
+                     ULONG count, ULONG map_crc);
+ULONG journal_resume (const char *fname, const char *avoid_fname,
+                      ULONG count, ULONG map_crc, int *ppending);
+void journal_begin (ULONG idx, ULONG sec, ULONG count, const void *old);
+void journal_done (void);
+void journal_close (int complete);
+ULONG journal_undo (const char *fname, const char *avoid_fname, DISKIO *d);
@@ -1235,7 +1235,7 @@ static void do_root_dir (DISKIO *d)
   find_ea_data (d, secno, root_entries);
   read_ea_data (d);
 
-  if (a_save || a_check || a_what || a_find)
+  if (a_save || a_check || a_what || a_find || a_owner)
     {
       path_chain link, *plink;
       struct vfat v;
@@ -1280,6 +1280,65 @@ static void check_alloc (void)
 }
 
 
+/* Record the boot sector, the FATs, the root directory, and all
+   allocated clusters with save_map_sectors().  For the `trim' action,
+   bad clusters are recorded as well as they must not be written. */
+
+#define SAVE_ALLOC(x) (ALLOCATED (x) || (a_trim && fat[x] == 0xfff7))
+
+static void save_alloc (void)
+{
+  ULONG i, start;
+
+  save_map_sectors (0, data_sector);
+  i = 2;
+  while (i < total_clusters)
+    if (SAVE_ALLOC (i))
+      {
+        start = i;
+        do
+          {
+            ++i;
+          } while (i < total_clusters && SAVE_ALLOC (i));
+        save_map_sectors (CLUSTER_TO_SECTOR (start),
+                          (i - start) * sectors_per_cluster);
+      }
+    else
+      ++i;
+}
+
+
+/* Pass the boot sector, the FATs, the root directory, and all used
+   clusters to owner_sectors(), merging adjacent clusters of the same
+   type and owner. */
+
+static void owner_export (void)
+{
+  ULONG i, start;
+  BYTE what;
+  const path_chain *path;
+
+  owner_sectors (0, first_sector, "boot sector", NULL);
+  owner_sectors (first_sector, number_of_fats * sectors_per_fat, "FAT", NULL);
+  owner_sectors (first_sector + number_of_fats * sectors_per_fat,
+                 root_sectors, "root directory", NULL);
+  i = 2;
+  while (i < total_clusters)
+    {
+      start = i; what = usage_vector[i]; path = path_vector[i];
+      do
+        {
+          ++i;
+        } while (i < total_clusters && usage_vector[i] == what
+                 && path_vector[i] == path);
+      if (what != USE_EMPTY)
+        owner_sectors (CLUSTER_TO_SECTOR (start),
+                       (i - start) * sectors_per_cluster,
+                       cluster_usage (what), path);
+    }
+}
+
+
 /* Process a FAT volume. */
 
 void do_fat (DISKIO *d, const FAT_SECTOR *pboot)
@@ -1400,4 +1459,10 @@ void do_fat (DISKIO *d, const FAT_SECTOR *pboot)
     {
       check_alloc ();
     }
+
+  if (a_alloc)
+    save_alloc ();
+
+  if (a_owner)
+    owner_export ();
 }
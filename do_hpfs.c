@@ -697,7 +697,7 @@ static void do_bitmap (DISKIO *d, ULONG secno, ULONG band, int show)
   read_sec (d, bitmap, secno, 4, TRUE);
   pos = band * 2048;
   first_sec = band * 2048 * 8;
-  if (a_info || a_check || a_what)
+  if (a_info || a_check || a_what || a_alloc)
     {
       if (pos + 2048 <= total_alloc)
         memcpy (alloc_vector + pos, bitmap, 2048);
@@ -806,19 +806,12 @@ static void do_bitmap_indirect (DISKIO *d, ULONG secno)
 }
 
 
-/* Compare two file names pointed to by P1 and P2.  CPIDX1 and CPIDX2
-   are the code page indices of the files.  If a code page index is
-   out of range, the current code page will be used. */
+/* Compare two file names pointed to by P1 and P2, using the case
+   mapping tables MAP1 and MAP2, respectively. */
 
-static int compare_fname (const BYTE *p1, const BYTE *p2,
-                          ULONG cpidx1, ULONG cpidx2)
+static int compare_fname_map (const BYTE *p1, const BYTE *p2,
+                              const BYTE *map1, const BYTE *map2)
 {
-  const BYTE *map1, *map2;
-
-  map1 = (cpidx1 >= code_page_count
-          ? cur_case_map : code_pages[cpidx1].case_map);
-  map2 = (cpidx2 >= code_page_count
-          ? cur_case_map : code_pages[cpidx2].case_map);
   for (;;)
     {
       if (*p1 == 0 && *p2 == 0)
@@ -836,11 +829,27 @@ static int compare_fname (const BYTE *p1, const BYTE *p2,
 }
 
 
+/* Compare two file names pointed to by P1 and P2.  CPIDX1 and CPIDX2
+   are the code page indices of the files.  If a code page index is
+   out of range, the current code page will be used. */
+
+static int compare_fname (const BYTE *p1, const BYTE *p2,
+                          ULONG cpidx1, ULONG cpidx2)
+{
+  return compare_fname_map (p1, p2,
+                            (cpidx1 >= code_page_count
+                             ? cur_case_map : code_pages[cpidx1].case_map),
+                            (cpidx2 >= code_page_count
+                             ? cur_case_map : code_pages[cpidx2].case_map));
+}
+
+
 /* Process one entry of a code page data sector.  The entry is in
    sector SECNO (used for messages, only).  PD points to the code page
    entry.  The length of the entry is LEN bytes.  CS is the expected
-   checksum for the entry.  Update our code page entry pointed to by
-   DST. */
+   checksum for the entry.  Mark the characters of the case mapping
+   table of our code page entry pointed to by DST which differ from
+   the system's case mapping table. */
 
 static void do_cpdata (ULONG secno, const CPDATAENTRY *pd, ULONG len,
                        ULONG cs, MYCP *dst)
@@ -850,7 +859,6 @@ static void do_cpdata (ULONG secno, const CPDATAENTRY *pd, ULONG len,
   BYTE map[128], c;
   BYTE dbcs[12];
 
-  memcpy (dst->case_map + 128, pd->bCaseMapTable, 128);
   for (c = 0; c < 128; ++c)
     map[c] = (BYTE)(c + 128);
   cc.country = USHORT_FROM_FS (pd->usCountryCode);
@@ -914,25 +922,32 @@ static void do_cpdata (ULONG secno, const CPDATAENTRY *pd, ULONG len,
 }
 
 
-/* Process a code page data sector.  DI is an index into
-   code_pages[]. */
+/* Process a code page data sector.  CPS points to the COUNT code
+   pages of the volume, DI is an index into CPS.  Build the case
+   mapping tables of the code pages stored in the sector.  If CHECK is
+   true, record the usage of the sector and check the tables against
+   the system's tables. */
 
-static void do_cpdatasec (DISKIO *d, ULONG di)
+static void do_cpdatasec (DISKIO *d, MYCP *cps, ULONG count, ULONG di,
+                          int check)
 {
-  ULONG secno, dcount, index, offset, len, j, c;
+  ULONG secno, dcount, index, offset, len, j, c, cs;
   HPFS_SECTOR cpdatasec;
   char used[512];
   const CPDATAENTRY *pd;
 
-  secno = ULONG_FROM_FS (code_pages[di].info.lsnCPData);
+  secno = ULONG_FROM_FS (cps[di].info.lsnCPData);
   for (j = 0; j < cpdata_count; ++j)
     if (cpdata_visited[j] == secno)
       return;
   cpdata_visited[cpdata_count++] = secno;
-  if (a_info || (a_what && secno == what_sector))
-    info ("Sector #%lu: Code page data sector\n", secno);
-  use_sectors (secno, 1, USE_CPDATASEC, NULL);
-  read_sec (d, &cpdatasec, secno, 1, TRUE);
+  if (check)
+    {
+      if (a_info || (a_what && secno == what_sector))
+        info ("Sector #%lu: Code page data sector\n", secno);
+      use_sectors (secno, 1, USE_CPDATASEC, NULL);
+    }
+  read_sec (d, &cpdatasec, secno, 1, check);
   if (ULONG_FROM_FS (cpdatasec.cpdatasec.sig) != CPDATA_SIG1)
     {
       warning (1, "CPDATASEC #%lu: Bad signature", secno);
@@ -948,20 +963,20 @@ static void do_cpdatasec (DISKIO *d, ULONG di)
   for (j = 0; j < dcount; ++j)
     {
       index = USHORT_FROM_FS (cpdatasec.cpdatasec.iFirstCP) + j;
-      if (index >= code_page_count)
+      if (index >= count)
         warning (1, "CPDATASEC #%lu: Index too big", secno);
       else
         {
-          code_pages[index].hit = TRUE;
+          cps[index].hit = TRUE;
           for (c = 0; c < 256; ++c)
             {
-              code_pages[index].case_map[c] = (BYTE)c;
-              code_pages[index].case_map_changed[c] = FALSE;
+              cps[index].case_map[c] = (BYTE)c;
+              cps[index].case_map_changed[c] = FALSE;
             }
           for (c = 'a'; c <= 'z'; ++c)
-            code_pages[index].case_map[c] = (BYTE)toupper (c);
-          if (ULONG_FROM_FS (cpdatasec.cpdatasec.cksCP[j])
-              != ULONG_FROM_FS (code_pages[index].info.cksCP))
+            cps[index].case_map[c] = (BYTE)toupper (c);
+          cs = ULONG_FROM_FS (cpdatasec.cpdatasec.cksCP[j]);
+          if (cs != ULONG_FROM_FS (cps[index].info.cksCP))
             warning (1, "CPDATASEC #%lu: Wrong checksum for code page %lu",
                      secno, index);
           offset = USHORT_FROM_FS (cpdatasec.cpdatasec.offCPData[j]);
@@ -972,7 +987,7 @@ static void do_cpdatasec (DISKIO *d, ULONG di)
             {
               pd = (const CPDATAENTRY *)(cpdatasec.raw + offset);
               if (USHORT_FROM_FS (pd->cDBCSRange)
-                  != USHORT_FROM_FS (code_pages[index].info.cDBCSRange))
+                  != USHORT_FROM_FS (cps[index].info.cDBCSRange))
                 warning (1, "CPDATASEC #%lu: Incorrect number of DBCS ranges",
                          secno);
               else
@@ -987,9 +1002,10 @@ static void do_cpdatasec (DISKIO *d, ULONG di)
                   else
                     {
                       memset (used + offset, TRUE, len);
-                      do_cpdata (secno, pd, len,
-                                 ULONG_FROM_FS (cpdatasec.cpdatasec.cksCP[j]),
-                                 &code_pages[index]);
+                      memcpy (cps[index].case_map + 128, pd->bCaseMapTable,
+                              128);
+                      if (check)
+                        do_cpdata (secno, pd, len, cs, &cps[index]);
                     }
                 }
             }
@@ -1001,23 +1017,29 @@ static void do_cpdatasec (DISKIO *d, ULONG di)
 /* Process one code page information sector.  PSECNO points to an
    object containing the sector number of the code page information
    sector.  The object will be modified to contain the sector number
-   of the next code page information sector.  The object pointed to by
-   PCOUNT contains the number of code pages.  The object will be
-   updated.  Return TRUE iff successful. */
-
-static int do_one_cpinfosec (DISKIO *d, ULONG *psecno, ULONG *pcount)
+   of the next code page information sector.  The entries are stored
+   to CPS, which has room for COUNT code pages.  The object pointed to
+   by PCOUNT contains the number of code pages.  The object will be
+   updated.  If CHECK is true, record the usage of the sector.  Return
+   TRUE iff successful. */
+
+static int do_one_cpinfosec (DISKIO *d, ULONG *psecno, MYCP *cps,
+                             ULONG count, ULONG *pcount, int check)
 {
   ULONG secno, i, n, next;
   HPFS_SECTOR cpinfosec;
   const CPINFOENTRY *pi;
 
   secno = *psecno;
-  if (a_info || (a_what && secno == what_sector))
-    info ("Sector #%lu: Code page information sector\n", secno);
-  if (have_seen (secno, 1, SEEN_CPINFOSEC, "code page information"))
-    return FALSE;
-  use_sectors (secno, 1, USE_CPINFOSEC, NULL);
-  read_sec (d, &cpinfosec, secno, 1, TRUE);
+  if (check)
+    {
+      if (a_info || (a_what && secno == what_sector))
+        info ("Sector #%lu: Code page information sector\n", secno);
+      if (have_seen (secno, 1, SEEN_CPINFOSEC, "code page information"))
+        return FALSE;
+      use_sectors (secno, 1, USE_CPINFOSEC, NULL);
+    }
+  read_sec (d, &cpinfosec, secno, 1, check);
   if (ULONG_FROM_FS (cpinfosec.cpinfosec.sig) != CPINFO_SIG1)
     {
       warning (1, "CPINFOSEC #%lu: Bad signature", secno);
@@ -1034,8 +1056,11 @@ static int do_one_cpinfosec (DISKIO *d, ULONG *psecno, ULONG *pcount)
   for (i = 0; i < n; ++i)
     {
       pi = &cpinfosec.cpinfosec.CPInfoEnt[i];
-      code_pages[*pcount].info = *pi;
-      code_pages[*pcount].hit = FALSE;
+      if (*pcount < count)
+        {
+          cps[*pcount].info = *pi;
+          cps[*pcount].hit = FALSE;
+        }
       if (a_info || (a_what && what_sector == secno))
         info ("  Code page index %lu: code page %u, country %u\n",
               i, USHORT_FROM_FS (pi->usCodePageID),
@@ -1053,32 +1078,47 @@ static int do_one_cpinfosec (DISKIO *d, ULONG *psecno, ULONG *pcount)
 
 
 /* Process the list of code page information sectors starting in
-   sector SECNO. */
-
-static void do_cpinfosec (DISKIO *d, ULONG secno)
+   sector SECNO and the code page data sectors.  PCOUNT points to the
+   number of code pages according to the spare block, which will be
+   lowered if there are fewer code pages.  Store a pointer to the
+   newly allocated code pages to *PCPS.  If CHECK is true, record the
+   usage of the sectors and check the code pages.  If CHECK is false
+   (for the `treediff' action), only the case mapping tables are
+   built. */
+
+static void do_cpinfosec (DISKIO *d, ULONG secno, MYCP **pcps,
+                          ULONG *pcount, int check)
 {
-  ULONG count, i;
+  ULONG count, i, sectors;
+  MYCP *cps;
 
-  code_pages = xmalloc (code_page_count * sizeof (MYCP));
+  cps = xmalloc (*pcount * sizeof (MYCP));
+  *pcps = cps;
   count = 0;
-  while (do_one_cpinfosec (d, &secno, &count))
-    ;
-  if (count != code_page_count)
+
+  /* Without the seen vector, stop at loops by limiting the length of
+     the chain. */
+
+  sectors = 0;
+  while (do_one_cpinfosec (d, &secno, cps, *pcount, &count, check))
+    if (!check && ++sectors > *pcount)
+      break;
+  if (count != *pcount)
     {
       warning (1, "Wrong number of code pages in code page information "
                "sectors");
-      if (count < code_page_count)
-        code_page_count = count;
+      if (count < *pcount)
+        *pcount = count;
     }
 
   cpdata_count = 0;
-  cpdata_visited = xmalloc (code_page_count * sizeof (*cpdata_visited));
-  for (i = 0; i < code_page_count; ++i)
-    do_cpdatasec (d, i);
+  cpdata_visited = xmalloc (*pcount * sizeof (*cpdata_visited));
+  for (i = 0; i < *pcount; ++i)
+    do_cpdatasec (d, cps, *pcount, i, check);
   free (cpdata_visited); cpdata_visited = NULL;
 
-  for (i = 0; i < code_page_count; ++i)
-    if (!code_pages[i].hit)
+  for (i = 0; i < *pcount; ++i)
+    if (!cps[i].hit)
       warning (1, "No code page data for code page index %lu", i);
   /* TODO: check for duplicate code pages */
 }
@@ -2607,6 +2647,60 @@ static void do_fnode (DISKIO *d, ULONG secno, const path_chain *path,
 }
 
 
+/* Record all sectors marked as allocated with save_map_sectors(). */
+
+static void save_alloc (void)
+{
+  ULONG i, start;
+
+  i = 0;
+  while (i < total_sectors)
+    if ((i & 31) == 0 && i + 32 <= total_sectors
+        && ((const ULONG *)alloc_vector)[i/32] == 0xffffffff)
+      i += 32;                  /* Skip 32 available sectors */
+    else if (ALLOCATED (i))
+      {
+        start = i;
+        do
+          {
+            if ((i & 31) == 0 && i + 32 <= total_sectors
+                && ((const ULONG *)alloc_vector)[i/32] == 0)
+              i += 32;          /* Skip 32 sectors in use */
+            else
+              ++i;
+          } while (i < total_sectors && ALLOCATED (i));
+        save_map_sectors (start, i - start);
+      }
+    else
+      ++i;
+}
+
+
+/* Pass all used sectors to owner_sectors(), merging adjacent
+   sectors of the same type and owner. */
+
+static void owner_export (void)
+{
+  ULONG i, start;
+  BYTE what;
+  const path_chain *path;
+
+  i = 0;
+  while (i < total_sectors)
+    {
+      start = i; what = usage_vector[i];
+      path = path_vector != NULL ? path_vector[i] : NULL;
+      do
+        {
+          ++i;
+        } while (i < total_sectors && usage_vector[i] == what
+                 && (path_vector != NULL ? path_vector[i] : NULL) == path);
+      if (what != USE_EMPTY)
+        owner_sectors (start, i - start, sec_usage (what), path);
+    }
+}
+
+
 /* Complain about sectors which are used but marked unallocated.
    Optionally complain about sectors which are not in use but marked
    allocated. */
@@ -2758,6 +2852,412 @@ static ULONG make_time (int y, int m, int d)
 }
 
 
+/* The `treediff' action compares the directory trees of two HPFS
+   volumes.  The DIRENTs of a directory are collected in a TD_DIR
+   structure, in the order of the B-tree of DIRBLKs, that is, sorted
+   by name. */
+
+typedef struct
+{
+  DIRENT dirent;                /* Copy of the DIRENT (without name) */
+  char *name;                   /* File name */
+} TD_ENTRY;
+
+typedef struct
+{
+  TD_ENTRY *vec;                /* The DIRENTs */
+  ULONG count;                  /* Number of DIRENTs */
+  ULONG alloc;                  /* Number of elements allocated */
+  hash_state hash;              /* Hash of all DIRBLKs of the directory */
+} TD_DIR;
+
+/* The code pages of an HPFS volume.  The code page indices of
+   DIRENTs refer to these code pages. */
+
+typedef struct
+{
+  ULONG count;                  /* Number of code pages */
+  MYCP *cps;                    /* The code pages */
+} TD_CP;
+
+static TD_CP td_cp1;            /* Code pages of the first volume */
+static TD_CP td_cp2;            /* Code pages of the second volume */
+static ULONG td_added;          /* Number of files added */
+static ULONG td_removed;        /* Number of files removed */
+static ULONG td_modified;       /* Number of files modified */
+
+
+/* Add the DIRENTs of the DIRBLK in sector SECNO of D and of all its
+   descendants to DIR.  PATH points to the path name chain of the
+   directory, LEVEL is the depth of the DIRBLK in the B-tree. */
+
+static void td_dirblk (DISKIO *d, ULONG secno, TD_DIR *dir,
+                       const path_chain *path, int level)
+{
+  DIRBLK blk;
+  const DIRENT *p;
+  char name[256];
+  int dirent_index;
+  ULONG length;
+  size_t pos;
+
+  if (level >= MAX_DIRBLK_LEVELS)
+    {
+      dirblk_warning (1, "DIRBLK tree too deep", secno, path);
+      return;
+    }
+  read_sec (d, &blk, secno, 4, FALSE);
+  if (ULONG_FROM_FS (blk.dirblk.sig) != DIRBLK_SIG1)
+    {
+      dirblk_warning (1, "Bad signature", secno, path);
+      return;
+    }
+  hash_update (&dir->hash, blk.raw, sizeof (blk.raw));
+  pos = offsetof (DIRBLK, dirblk.dirent);
+  for (dirent_index = 0;; ++dirent_index)
+    {
+      p = check_dirent (&blk, pos, name, TRUE, secno, path, dirent_index);
+      if (p == NULL)
+        break;
+      length = USHORT_FROM_FS (p->cchThisEntry);
+      if (p->bFlags & DF_BTP)
+        td_dirblk (d, ((ULONG *)((const char *)p + length))[-1], dir, path,
+                   level + 1);
+      if (p->bFlags & DF_END)
+        break;
+      if (!(p->bFlags & DF_SPEC))
+        {
+          if (dir->count >= dir->alloc)
+            {
+              dir->alloc = dir->alloc == 0 ? 64 : 2 * dir->alloc;
+              dir->vec = realloc (dir->vec, dir->alloc * sizeof (*dir->vec));
+              if (dir->vec == NULL)
+                error ("Out of memory");
+            }
+          dir->vec[dir->count].dirent = *p;
+          dir->vec[dir->count].name = xmalloc (strlen (name) + 1);
+          strcpy (dir->vec[dir->count].name, name);
+          ++dir->count;
+        }
+      pos += length;
+    }
+}
+
+
+/* Read the code pages of the HPFS volume D into CP. */
+
+static void td_code_pages (DISKIO *d, TD_CP *cp)
+{
+  HPFS_SECTOR spareb;
+
+  read_sec (d, &spareb, 17, 1, FALSE);
+  cp->count = 0; cp->cps = NULL;
+  if (ULONG_FROM_FS (spareb.spareb.sig1) != SPARE_SIG1
+      || ULONG_FROM_FS (spareb.spareb.sig2) != SPARE_SIG2)
+    return;
+
+  /* The code page index of a DIRENT has 7 bits. */
+
+  cp->count = MIN (ULONG_FROM_FS (spareb.spareb.culCP), 128);
+  if (cp->count != 0)
+    do_cpinfosec (d, ULONG_FROM_FS (spareb.spareb.lsnCPInfo), &cp->cps,
+                  &cp->count, FALSE);
+}
+
+
+/* Return the case mapping table of CP for the DIRENT P.  Use the
+   current code page if the code page of P is not available. */
+
+static const BYTE *td_case_map (const TD_CP *cp, const DIRENT *p)
+{
+  ULONG cpindex;
+
+  cpindex = p->bCodePage & 0x7f;
+  return (cpindex < cp->count && cp->cps[cpindex].hit
+          ? cp->cps[cpindex].case_map : cur_case_map);
+}
+
+
+/* Read the directory whose FNODE is in sector SECNO of D into DIR.
+   PATH points to the path name chain of the directory. */
+
+static void td_read_dir (DISKIO *d, ULONG secno, TD_DIR *dir,
+                         const path_chain *path)
+{
+  HPFS_SECTOR fnode;
+
+  dir->vec = NULL; dir->count = 0; dir->alloc = 0;
+  hash_init (&dir->hash, HASH_XXH64);
+  read_sec (d, &fnode, secno, 1, FALSE);
+  if (ULONG_FROM_FS (fnode.fnode.sig) != FNODE_SIG1)
+    fnode_warning (1, "Bad signature", secno, path);
+  else if (!(fnode.fnode.bFlag & FNF_DIR))
+    fnode_warning (1, "Incorrect directory bit", secno, path);
+  else
+    td_dirblk (d, ULONG_FROM_FS (fnode.fnode.fst.a.aall[0].lsnPhys), dir,
+               path, 0);
+}
+
+
+/* Free the DIRENTs of DIR. */
+
+static void td_free_dir (TD_DIR *dir)
+{
+  ULONG i;
+
+  for (i = 0; i < dir->count; ++i)
+    free (dir->vec[i].name);
+  free (dir->vec);
+}
+
+
+/* Return true if the allocation structures starting with the ALBLKs
+   A1 of D1 and A2 of D2 differ.  The ALBLKs have room for LEAVES
+   ALLEAFs.  The ALSECs of identical ALNODEs are compared
+   recursively, LEVEL is the depth in the allocation tree. */
+
+static int td_storage_differs (DISKIO *d1, DISKIO *d2, const ALBLK *a1,
+                               const ALBLK *a2, ULONG leaves, int level)
+{
+  HPFS_SECTOR s1, s2;
+  const ALNODE *pn;
+  ULONG i, n, size;
+
+  if (a1->bFlag != a2->bFlag || a1->cUsed != a2->cUsed)
+    return TRUE;
+  if (a1->bFlag & ABF_NODE)
+    {
+      n = MIN (a1->cUsed, leaves * sizeof (ALLEAF) / sizeof (ALNODE));
+      size = n * sizeof (ALNODE);
+    }
+  else
+    {
+      n = MIN (a1->cUsed, leaves);
+      size = n * sizeof (ALLEAF);
+    }
+  if (memcmp (a1 + 1, a2 + 1, size) != 0)
+    return TRUE;
+  if (!(a1->bFlag & ABF_NODE))
+    return FALSE;
+  if (level >= MAX_DIRBLK_LEVELS)
+    return TRUE;
+  pn = (const ALNODE *)(a1 + 1);
+  for (i = 0; i < n; ++i)
+    {
+      read_sec (d1, &s1, ULONG_FROM_FS (pn[i].lsnPhys), 1, FALSE);
+      read_sec (d2, &s2, ULONG_FROM_FS (pn[i].lsnPhys), 1, FALSE);
+      if (ULONG_FROM_FS (s1.alsec.sig) != ALSEC_SIG1
+          || ULONG_FROM_FS (s2.alsec.sig) != ALSEC_SIG1)
+        return TRUE;
+      if (td_storage_differs (d1, d2, &s1.alsec.alb, &s2.alsec.alb, 40,
+                              level + 1))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+
+/* Return true if the extended attributes stored in or referenced by
+   the FNODEs P1 and P2 differ. */
+
+static int td_eas_differ (const FNODE *p1, const FNODE *p2)
+{
+  ULONG off, len;
+
+  if (memcmp (&p1->aiEA, &p2->aiEA, sizeof (p1->aiEA)) != 0)
+    return TRUE;
+  off = (USHORT_FROM_FS (p1->usACLBase) + USHORT_FROM_FS (p1->aiACL.usFNL));
+  len = USHORT_FROM_FS (p1->aiEA.usFNL);
+  if (off + len > 512)
+    return FALSE;
+  return memcmp ((const BYTE *)p1 + off, (const BYTE *)p2 + off, len) != 0;
+}
+
+
+/* Append the word WHAT to the list of changes in BUF. */
+
+static void td_change (char *buf, const char *what)
+{
+  if (*buf != 0)
+    strcat (buf, ", ");
+  strcat (buf, what);
+}
+
+
+/* Compare the files E1 of D1 and E2 of D2.  PATH points to the path
+   name chain of the file.  If SAME_DIR is true, the DIRBLKs of the
+   directories containing the files are identical and the FNODEs are
+   not read. */
+
+static void td_file (DISKIO *d1, DISKIO *d2, const TD_ENTRY *e1,
+                     const TD_ENTRY *e2, const path_chain *path,
+                     int same_dir)
+{
+  const DIRENT *p1, *p2;
+  HPFS_SECTOR f1, f2;
+  char buf[80];
+
+  p1 = &e1->dirent; p2 = &e2->dirent;
+  buf[0] = 0;
+  if (p1->bAttr != p2->bAttr)
+    td_change (buf, "attributes");
+  if (p1->cchFSize != p2->cchFSize)
+    td_change (buf, "size");
+  if (p1->timLastMod != p2->timLastMod)
+    td_change (buf, "modified");
+  if (p1->timCreate != p2->timCreate)
+    td_change (buf, "created");
+  if (p1->ulEALen != p2->ulEALen)
+    td_change (buf, "EAs");
+  if (p1->lsnFNode != p2->lsnFNode)
+    td_change (buf, "FNODE");
+  if (buf[0] == 0 && !same_dir)
+    {
+      /* The DIRENTs are identical.  Compare the allocation
+         structures and the EAs of the FNODEs. */
+
+      read_sec (d1, &f1, ULONG_FROM_FS (p1->lsnFNode), 1, FALSE);
+      read_sec (d2, &f2, ULONG_FROM_FS (p2->lsnFNode), 1, FALSE);
+      if (ULONG_FROM_FS (f1.fnode.sig) != FNODE_SIG1
+          || ULONG_FROM_FS (f2.fnode.sig) != FNODE_SIG1)
+        td_change (buf, "FNODE");
+      else
+        {
+          if (f1.fnode.fst.ulVLen != f2.fnode.fst.ulVLen
+              || td_storage_differs (d1, d2, &f1.fnode.fst.alb,
+                                     &f2.fnode.fst.alb, 8, 0))
+            td_change (buf, "extents");
+          if (td_eas_differ (&f1.fnode, &f2.fnode))
+            td_change (buf, "EAs");
+        }
+    }
+  if (buf[0] != 0)
+    {
+      info ("Modified: %s (%s)\n", format_path_chain (path, NULL), buf);
+      ++td_modified;
+    }
+}
+
+
+/* Show the file or directory E as added (WHAT is "Added") or removed
+   (WHAT is "Removed").  PATH points to the path name chain of the
+   directory containing E. */
+
+static void td_show (const char *what, const TD_ENTRY *e,
+                     const path_chain *path)
+{
+  info ("%-9s %s%s\n", what, format_path_chain (path, e->name),
+        (e->dirent.bAttr & ATTR_DIR) ? " (directory)" : "");
+}
+
+
+/* Compare the directories whose FNODEs are in sector SECNO1 of D1 and
+   sector SECNO2 of D2.  PATH points to the path name chain of the
+   directories.  Both directories are read in sorted order and merged;
+   subdirectories present in both sources are compared
+   recursively. */
+
+static void td_dir (DISKIO *d1, DISKIO *d2, ULONG secno1, ULONG secno2,
+                    const path_chain *path)
+{
+  TD_DIR dir1, dir2;
+  const TD_ENTRY *e1, *e2;
+  ULONG i1, i2;
+  int cmp, same_dir, dir_flag1, dir_flag2;
+  path_chain link, *plink;
+
+  td_read_dir (d1, secno1, &dir1, path);
+  td_read_dir (d2, secno2, &dir2, path);
+  same_dir = (dir1.count == dir2.count
+              && hash_final (&dir1.hash) == hash_final (&dir2.hash));
+  i1 = 0; i2 = 0;
+  while (i1 < dir1.count || i2 < dir2.count)
+    {
+      e1 = i1 < dir1.count ? &dir1.vec[i1] : NULL;
+      e2 = i2 < dir2.count ? &dir2.vec[i2] : NULL;
+      if (e1 == NULL)
+        cmp = 1;
+      else if (e2 == NULL)
+        cmp = -1;
+      else
+        cmp = compare_fname_map ((const BYTE *)e1->name,
+                                 (const BYTE *)e2->name,
+                                 td_case_map (&td_cp1, &e1->dirent),
+                                 td_case_map (&td_cp2, &e2->dirent));
+      if (cmp < 0)
+        {
+          td_show ("Removed:", e1, path); ++td_removed; ++i1;
+          continue;
+        }
+      if (cmp > 0)
+        {
+          td_show ("Added:", e2, path); ++td_added; ++i2;
+          continue;
+        }
+      dir_flag1 = (e1->dirent.bAttr & ATTR_DIR) != 0;
+      dir_flag2 = (e2->dirent.bAttr & ATTR_DIR) != 0;
+      if (dir_flag1 != dir_flag2)
+        {
+          td_show ("Removed:", e1, path); ++td_removed;
+          td_show ("Added:", e2, path); ++td_added;
+        }
+      else if (strlen (e1->name) + path_chain_len (path) > 255)
+        warning (1, "Path name too long: \"%s\"",
+                 format_path_chain (path, e1->name));
+      else
+        {
+          plink = PATH_CHAIN_NEW (&link, path, e1->name);
+          if (dir_flag1)
+            td_dir (d1, d2, ULONG_FROM_FS (e1->dirent.lsnFNode),
+                    ULONG_FROM_FS (e2->dirent.lsnFNode), plink);
+          else
+            td_file (d1, d2, e1, e2, plink, same_dir);
+        }
+      ++i1; ++i2;
+    }
+  td_free_dir (&dir1);
+  td_free_dir (&dir2);
+}
+
+
+/* Read the Superblock of D into SUPERB and make sure that D contains
+   an HPFS volume.  FNAME is the name of the source. */
+
+static void td_super (DISKIO *d, HPFS_SECTOR *superb, const char *fname)
+{
+  read_sec (d, superb, 16, 1, FALSE);
+  if (ULONG_FROM_FS (superb->superb.sig1) != SUPER_SIG1
+      || ULONG_FROM_FS (superb->superb.sig2) != SUPER_SIG2)
+    error ("%s: Invalid signature of superblock -- this is not an HPFS "
+           "partition", fname);
+}
+
+
+/* `treediff' action: compare the directory trees of the HPFS volumes
+   D1 (named FNAME1) and D2 (named FNAME2), reading only metadata.
+   List the files and directories added, removed, and modified. */
+
+void treediff_hpfs (DISKIO *d1, DISKIO *d2, const char *fname1,
+                    const char *fname2)
+{
+  HPFS_SECTOR superb1, superb2;
+  path_chain link, *plink;
+
+  td_super (d1, &superb1, fname1);
+  td_super (d2, &superb2, fname2);
+  td_code_pages (d1, &td_cp1);
+  td_code_pages (d2, &td_cp2);
+  td_added = 0; td_removed = 0; td_modified = 0;
+  plink = PATH_CHAIN_NEW (&link, NULL, "");
+  td_dir (d1, d2, ULONG_FROM_FS (superb1.superb.lsnRootFNode),
+          ULONG_FROM_FS (superb2.superb.lsnRootFNode), plink);
+  free (td_cp1.cps); free (td_cp2.cps);
+  if (td_added + td_removed + td_modified != 0)
+    info ("  (%lu added, %lu removed, %lu modified)\n",
+          td_added, td_removed, td_modified);
+}
+
+
 /* Process an HPFS volume. */
 
 void do_hpfs (DISKIO *d)
@@ -2819,7 +3319,7 @@ void do_hpfs (DISKIO *d)
      Note that the following condition must match the condition in the
      PATH_CHAIN_NEW macro! */
 
-  if (a_check && plenty_memory)
+  if ((a_check && plenty_memory) || a_owner)
     {
       path_vector = xmalloc (total_sectors * sizeof (*path_vector));
       for (i = 0; i < total_sectors; ++i)
@@ -3002,7 +3502,7 @@ void do_hpfs (DISKIO *d)
      The vector will be filled in by do_bitmap(), called by
      do_bitmap_indirect().  */
 
-  if (a_check || a_info || a_what)
+  if (a_check || a_info || a_what || a_alloc)
     {
       total_alloc = DIVIDE_UP (total_sectors, 8);
       alloc_vector = (BYTE *)xmalloc (total_alloc);
@@ -3070,7 +3570,7 @@ void do_hpfs (DISKIO *d)
         }
     }
 
-  if (a_check || a_info || a_save || a_what)
+  if (a_check || a_info || a_save || a_what || a_owner)
     {
       /* Process the bad block list. */
 
@@ -3085,13 +3585,14 @@ void do_hpfs (DISKIO *d)
 
   /* Process the allocation bitmaps.  This fills in alloc_vector. */
 
-  if (a_check || a_info || a_save || a_what)
+  if (a_check || a_info || a_save || a_what || a_alloc || a_owner)
     do_bitmap_indirect (d, ULONG_FROM_FS (superb.superb.rspBitMapIndBlk.lsnMain));
 
   /* Process the list of code page sectors. */
 
-  if (a_check || a_info || a_save || a_what || a_find)
-    do_cpinfosec (d, ULONG_FROM_FS (spareb.spareb.lsnCPInfo));
+  if (a_check || a_info || a_save || a_what || a_find || a_owner)
+    do_cpinfosec (d, ULONG_FROM_FS (spareb.spareb.lsnCPInfo), &code_pages,
+                  &code_page_count, TRUE);
 
   /* Now comes the most interesting part: Walk through all directories
      and files, starting in the root directory. */
@@ -3099,7 +3600,7 @@ void do_hpfs (DISKIO *d)
   file_count = 0; dir_count = 0;
   extents_init (&file_extents);
   extents_init (&ea_extents);
-  if (a_check || a_save || a_what || a_find)
+  if (a_check || a_save || a_what || a_find || a_owner)
     {
       path_chain link, *plink;
 
@@ -3111,7 +3612,7 @@ void do_hpfs (DISKIO *d)
 
   /* Process the DIRBLK bitmap. */
 
-  if (a_check || a_save)
+  if (a_check || a_save || a_owner)
     do_dirblk_bitmap (d, ULONG_FROM_FS (superb.superb.lsnDirBlkMap),
                       dirband_start, dirband_sectors / 4);
 
@@ -3139,6 +3640,16 @@ void do_hpfs (DISKIO *d)
         }
     }
 
+  /* Record the allocated sectors for `crc -a'. */
+
+  if (a_alloc)
+    save_alloc ();
+
+  /* Pass the usage of the sectors to `diff -e'. */
+
+  if (a_owner)
+    owner_export ();
+
   /* Show fragmentation of free space. */
 
   if (a_info && show_free_frag)
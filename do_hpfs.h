@@ -20,3 +20,5 @@ Boston, MA 02111-1307, USA.  */
 
 
 void do_hpfs (DISKIO *d);
+void treediff_hpfs (DISKIO *d1, DISKIO *d2, const char *fname1,
+                    const char *fname2);
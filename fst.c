@@ -28,6 +28,8 @@ Boston, MA 02111-1307, USA.  */
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <io.h>
+#include <fcntl.h>
 #include "fst.h"
 #include "crc.h"
 #include "diskio.h"
@@ -51,6 +53,9 @@ char a_where;                   /* Non-zero for `info <path>' action */
 char a_copy;                    /* Non-zero for `copy' action */
 char a_dir;                     /* Non-zero for `dir' action */
 char a_find;                    /* Non-zero for finding a file */
+char a_alloc;                   /* Non-zero for `crc -a' */
+char a_owner;                   /* Non-zero for `diff -e' */
+char a_trim;                    /* Non-zero for `trim' action */
 char plenty_memory;             /* Non-zero for `check -m' */
 char check_unused;              /* Non-zero for `check -u' */
 char check_pedantic;            /* Non-zero for `check -p' */
@@ -63,6 +68,52 @@ char force_fs;                  /* Non-zero to force to a specific fs */
 ULONG what_sector;              /* Sector number for `info <number>' action */
 char what_cluster_flag;         /* `what_sector' is a cluster number */
 const char *find_path;          /* (Remainder of) pathname for a_find */
+static int threads = 4;         /* Number of threads (`-j=<threads>') */
+
+/* Number of CRCs computed and written at a time by the `crc'
+   action. */
+
+#define CRC_FILE_CHUNK  65536
+
+/* Number of sectors compared at a time by the `diff' action when
+   comparing disks and snapshot files. */
+
+#define DIFF_CHUNK      65536
+
+/* Maximum number of sources of the `diff' action, and number of
+   sectors processed at a time when comparing more than two sources. */
+
+#define DIFF_MAX_SOURCES 8
+#define DIFF_MULTI_CHUNK 256
+
+/* Maximum number of consecutive sectors read, compared, and written
+   at a time by the `restore' action. */
+
+#define RESTORE_CHUNK   256
+
+/* Maximum number of consecutive sectors read and written at a time by
+   the `export' action. */
+
+#define EXPORT_CHUNK    256
+
+/* Number of sectors read and written at a time by the `image'
+   action. */
+
+#define IMAGE_CHUNK     1024
+
+/* Number of sectors read and checked at a time by the `trim'
+   action. */
+
+#define TRIM_CHUNK      1024
+
+/* Number of sectors transferred at a time by the `read' and `write'
+   actions. */
+
+#define READ_WRITE_CHUNK 256
+
+/* Number of CRCs compared with one memcmp() by crc_diff_range(). */
+
+#define CRC_CMP_BLOCK   1024
 
 /* This table maps lower-case letters to upper case, using the current
    code page. */
@@ -77,6 +128,7 @@ static int warning_count[2];    /* Index 0: warnings, index 1: errors */
 static char list_going;         /* Non-zero if list started */
 static int list_x;              /* Column */
 static char list_msg[80];       /* Message */
+static FILE *total_file;        /* Where to show the totals (NULL: stdout) */
 
 /* path_chain_new() tries to avoid malloc()'s memory overhead by
    allocating reasonably big buffers out of which the strings and
@@ -106,11 +158,18 @@ void quit (int rc, int show)
   if (save_file != NULL)
     {
       fclose (save_file);
+
+      /* Keep incomplete CRC files for `crc -resume'.  Sparse CRC
+         files cannot be resumed.  Don't try to remove standard
+         output. */
+
+      if (save_file != stdout && !save_resumable ())
+        remove (save_fname);
       save_file = NULL;
-      remove (save_fname);
     }
   if (warning_count[0] != 0 || warning_count[1] != 0 || show)
-    fprintf (stdout, "Total warnings: %d, total errors: %d\n",
+    fprintf (total_file != NULL ? total_file : stdout,
+             "Total warnings: %d, total errors: %d\n",
              warning_count[0], warning_count[1]);
   if (rc == 0 && warning_count[1] != 0)
     rc = 1;
@@ -677,11 +736,17 @@ static void usage (void)
         "  check     Check the file system\n"
         "  save      Take a snapshot of the file system\n"
         "  diff      Compare snapshot files, CRC files, and disks\n"
+        "  treediff  List files added, removed, or modified on HPFS\n"
         "  restore   Copy sectors from snapshot file to disk\n"
+        "  merge     Combine snapshot files into one snapshot file\n"
+        "  export    Write a snapshot file to a raw image file\n"
+        "  image     Copy the used sectors of a disk to a raw image file\n"
+        "  trim      Fill the free sectors of a disk with zeros\n"
+        "  verify    Check the integrity of a snapshot file\n"
         "  dir       List a directory\n"
         "  copy      Copy a file from the disk\n"
-        "  read      Copy a sector to a file\n"
-        "  write     Write a sector from a file to disk\n"
+        "  read      Copy sectors to a file\n"
+        "  write     Write sectors from a file to disk\n"
         "  crc       Save CRCs for all sectors of a disk");
   quit (1, FALSE);
 }
@@ -694,10 +759,13 @@ static void usage_info (void)
         " fst [<fst_options>] info [-f] [-u] <source>\n"
         " fst [<fst_options>] info [-e]      <source> <path>\n"
         " fst [<fst_options>] info [-c]      <source> <number>\n"
+        " fst [<fst_options>] info -A=<map_file> [-t] <source>\n"
         "Options:\n"
+        "  -A        Write the allocated sectors to the sector map file <map_file>\n"
         "  -c        <number> is a cluster number instead of a sector number\n"
         "  -e        Show names of extended attributes\n"
         "  -f        Show fragmentation of free space\n"
+        "  -t        Write <map_file> as text\n"
         "  -u        Show unallocated sectors\n"
         "Arguments:\n"
         "  <source>  A drive name (eg, \"C:\") or snapshot file\n"
@@ -729,8 +797,9 @@ static void usage_save (void)
 {
   puts (banner);
   puts ("Usage:\n"
-        "  fst [<fst_options>] save [-v] <source> <target>\n"
+        "  fst [<fst_options>] save [-b=<base>] [-v] <source> <target>\n"
         "Options:\n"
+        "  -b        Save only sectors which differ from snapshot file <base>\n"
         "  -v        Verbose -- show path names\n"
         "Arguments:\n"
         "  <source>  A drive name (eg, \"C:\") or a snapshot file\n"
@@ -743,9 +812,14 @@ static void usage_restore (void)
 {
   puts (banner);
   puts ("Usage:\n"
-        "  fst [<fst_options>] restore [-s=<backup>] <target> <source> [<sector>]\n"
+        "  fst [<fst_options>] restore [-s=<backup>] [-l=<journal>] <target> <source> [<sector>]\n"
+        "  fst [<fst_options>] restore -l=<journal> -resume <target> <source> [<sector>]\n"
+        "  fst [<fst_options>] restore -l=<journal> -undo <target>\n"
         "Options:\n"
         "  -s        Save old sectors into snapshot file <backup>\n"
+        "  -l        Record old sectors in undo journal <journal>\n"
+        "  -resume   Continue an interrupted restore recorded in <journal>\n"
+        "  -undo     Write back the old sectors recorded in <journal>\n"
         "Arguments:\n"
         "  <target>  A drive name (eg, \"C:\") or a snapshot file\n"
         "  <source>  Name of the snapshot file to be copied to disk\n"
@@ -754,6 +828,66 @@ static void usage_restore (void)
 }
 
 
+static void usage_merge (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] merge <target> <source> <source>...\n"
+        "Arguments:\n"
+        "  <target>  Name of the snapshot file to be created\n"
+        "  <source>  Snapshot file (oldest first, newest last)");
+  quit (1, FALSE);
+}
+
+
+static void usage_export (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] export <source> <target>\n"
+        "Arguments:\n"
+        "  <source>  Name of the snapshot file\n"
+        "  <target>  Name of the image file to be created");
+  quit (1, FALSE);
+}
+
+
+static void usage_image (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] image <source> <target>\n"
+        "Arguments:\n"
+        "  <source>  A drive name (eg, \"C:\")\n"
+        "  <target>  Name of the image file to be created");
+  quit (1, FALSE);
+}
+
+
+static void usage_trim (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] trim <target>\n"
+        "Arguments:\n"
+        "  <target>  A drive name (eg, \"C:\")");
+  quit (1, FALSE);
+}
+
+
+static void usage_verify (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] verify [-j=<threads>] <source>\n"
+        "Options:\n"
+        "  -j        Number of threads (1 through 16, default: 4)\n"
+        "Arguments:\n"
+        "  <source>  Name of the snapshot file");
+  quit (1, FALSE);
+}
+
+
 static void usage_copy (void)
 {
   puts (banner);
@@ -783,11 +917,12 @@ static void usage_read (void)
 {
   puts (banner);
   puts ("Usage:\n"
-        "  fst [<fst_options>] read <source> <target> <sector>\n"
+        "  fst [<fst_options>] read <source> <target> <sector> [<count>]\n"
         "Arguments:\n"
         "  <source>  A drive name (eg, \"C:\") or a snapshot file\n"
-        "  <target>  Name of target file\n"
-        "  <sector>  A sector number");
+        "  <target>  Name of target file, \"-\" for standard output\n"
+        "  <sector>  Number of the first sector\n"
+        "  <count>   Number of sectors (default: 1)");
   quit (1, FALSE);
 }
 
@@ -799,8 +934,8 @@ static void usage_write (void)
         "  fst [<fst_options>] write <target> <source> <sector>\n"
         "Arguments:\n"
         "  <target>  A drive name (eg, \"C:\") or a snapshot file\n"
-        "  <source>  Name of source file\n"
-        "  <sector>  A sector number");
+        "  <source>  Name of source file, \"-\" for standard input\n"
+        "  <sector>  Number of the first sector");
   quit (1, FALSE);
 }
 
@@ -809,7 +944,12 @@ static void usage_diff (void)
 {
   puts (banner);
   puts ("Usage:\n"
-        "  fst [<fst_options>] diff <file1> <file2>\n"
+        "  fst [<fst_options>] diff [-e] [-j=<threads>] [-o=<map_file>] <file1> <file2>\n"
+        "  fst [<fst_options>] diff [-o=<map_file>] <file1> <file2> <file3>...\n"
+        "Options:\n"
+        "  -e        Show the type and owner of the sectors listed\n"
+        "  -j        Number of threads (1 through 16, default: 4)\n"
+        "  -o        Write the sectors listed to a sector map file\n"
         "Arguments:\n"
         "  <file1>   Drive name, snapshot file, or CRC file (old)\n"
         "  <file2>   Drive name, snapshot file, or CRC file (new)");
@@ -817,30 +957,94 @@ static void usage_diff (void)
 }
 
 
+static void usage_treediff (void)
+{
+  puts (banner);
+  puts ("Usage:\n"
+        "  fst [<fst_options>] treediff <source1> <source2>\n"
+        "Arguments:\n"
+        "  <source1> Drive name or snapshot file (old)\n"
+        "  <source2> Drive name or snapshot file (new)");
+  quit (1, FALSE);
+}
+
+
 static void usage_crc (void)
 {
   puts (banner);
   puts ("Usage:\n"
-        "  fst [<fst_options>] crc <source> <target>\n"
+        "  fst [<fst_options>] crc [-b=<size>] [-H=<hash>] [-j=<threads>] [-resume] <source> <target>\n"
+        "  fst [<fst_options>] crc -m|-a [-H=<hash>] [-j=<threads>] <source> <target>\n"
+        "  fst [<fst_options>] crc -r=<first>-<last> [-j=<threads>] <source>\n"
+        "Options:\n"
+        "  -b        Block size (512 through 1024k, power of two; builds a tree)\n"
+        "  -H        Hash algorithm: crc32 (default) or xxh64\n"
+        "  -j        Number of threads (1 through 16, default: 4)\n"
+        "  -resume   Continue an incomplete CRC file\n"
+        "  -m        Only sectors which would be saved by `save' (sparse)\n"
+        "  -a        Only allocated sectors (sparse)\n"
+        "  -r        Show the CRC of a range of sectors\n"
         "Arguments:\n"
-        "  <source>  A drive name (eg, \"C:\")\n"
+        "  <source>  A drive name (eg, \"C:\"), or a CRC file (-r)\n"
         "  <target>  Name of CRC file to be written");
   quit (1, FALSE);
 }
 
 
+/* Return the number of sectors of the file system of D, taken from
+   the BPB of the boot sector (which is present for both FAT and
+   HPFS).  Return 0 if the BPB is not valid. */
+
+static ULONG boot_total (DISKIO *d)
+{
+  FAT_SECTOR boot;
+
+  read_sec (d, &boot, 0, 1, FALSE);
+  if (USHORT_FROM_FS (boot.boot.bytes_per_sector) != 512)
+    return 0;
+  if (USHORT_FROM_FS (boot.boot.sectors) != 0)
+    return USHORT_FROM_FS (boot.boot.sectors);
+  return ULONG_FROM_FS (boot.boot.large_sectors);
+}
+
+
+/* Return the number of sectors of the disk from which the snapshot
+   file D has been taken.  SORT is the sorted array of the sector
+   numbers of D.  The number of sectors is taken from the boot sector,
+   if the boot sector is in the snapshot file. */
+
+static ULONG snapshot_total (DISKIO *d, const ULONG *sort)
+{
+  ULONG n, total;
+
+  n = diskio_snapshot_sectors (d);
+  total = n == 0 ? 0 : sort[n-1] + 1;
+  if (n != 0 && sort[0] == 0)
+    total = MAX (total, boot_total (d));
+  return total;
+}
+
+
 /* `info' action. */
 
 static void cmd_info (int argc, char *argv[])
 {
   DISKIO *d;
-  int i;
+  int i, text;
   char *e;
   cyl_head_sec chs;
+  ULONG *sort, *ranges, n, r, count, range_count;
 
-  i = 1;
+  i = 1; text = FALSE; save_fname = NULL;
   while (i < argc)
-    if (strcmp (argv[i], "-c") == 0)
+    if (strncmp (argv[i], "-A=", 3) == 0)
+      {
+        if (argv[i][3] == 0)
+          usage_info ();
+        save_fname = argv[i] + 3;
+        ++i;
+      }
+    else if (strcmp (argv[i], "-c") == 0)
       {
         what_cluster_flag = TRUE; ++i;
       }
@@ -852,6 +1056,10 @@ static void cmd_info (int argc, char *argv[])
       {
         show_free_frag = TRUE; ++i;
       }
+    else if (strcmp (argv[i], "-t") == 0)
+      {
+        text = TRUE; ++i;
+      }
     else if (strcmp (argv[i], "-u") == 0)
       {
         show_unused = TRUE; ++i;
@@ -860,7 +1068,15 @@ static void cmd_info (int argc, char *argv[])
       break;
   if (i >= argc || argv[i][0] == '-')
     usage_info ();
-  if (argc - i == 1)
+  if (text && save_fname == NULL)
+    usage_info ();
+  if (save_fname != NULL)
+    {
+      if (argc - i != 1 || what_cluster_flag || show_eas || show_free_frag
+          || show_unused)
+        usage_info ();
+    }
+  else if (argc - i == 1)
     {
       a_info = TRUE;
       if (what_cluster_flag || show_eas)
@@ -891,6 +1107,37 @@ static void cmd_info (int argc, char *argv[])
   info_file = stdout; diag_file = stderr; prog_file = stderr;
   d = diskio_open ((PCSZ)argv[i], DIO_DISK | DIO_SNAPSHOT, FALSE);
 
+  /* Write the allocated sectors to a sector map file.  The number of
+     sectors of the disk is not recorded in a snapshot file. */
+
+  if (save_fname != NULL)
+    {
+      n = diskio_total_sectors (d);
+      if (diskio_type (d) == DIO_SNAPSHOT)
+        {
+          sort = diskio_snapshot_sort (d);
+          n = snapshot_total (d, sort);
+          free (sort);
+        }
+      save_map_create (n);
+      a_alloc = TRUE;
+      do_disk (d);
+      a_alloc = FALSE;
+      ranges = save_map_ranges (&range_count);
+      count = 0;
+      for (r = 0; r < range_count; ++r)
+        count += ranges[2*r+1];
+      if (text)
+        save_map_text (argv[i], ranges, range_count);
+      else
+        save_map_file (argv + i, 1, n, ranges, range_count);
+      info ("%lu of %lu sectors allocated, %lu ranges\n",
+            count, n, range_count);
+      free (ranges);
+      diskio_close (d);
+      return;
+    }
+
   if (a_what && !what_cluster_flag
       && diskio_cyl_head_sec (d, &chs, what_sector))
     info ("Sector #%lu: Cylinder %lu, head %lu, sector %lu\n",
@@ -949,23 +1196,222 @@ static void cmd_check (int argc, char *argv[])
 }
 
 
-/* Compare sectors of two snapshot files.  The operation is controlled
-   by WHICH:
-        0    compare sectors which are in both files
+/* The `diff' action lists ranges of sectors.  These variables hold
+   the range not yet listed and the counts for the summary of the
+   current list.  If diff_map is non-zero, the listed sectors are also
+   recorded with save_map_sectors() for `diff -o'. */
+
+static ULONG diff_range_start;
+static ULONG diff_range_count;
+static ULONG diff_sector_total;
+static ULONG diff_range_total;
+static char diff_map;
+
+
+/* For `diff -e', these variables hold the sectors of the newer
+   source which are used by the file system, sorted by sector number,
+   with their type and owner.  owner_last_chain and owner_last_path
+   avoid formatting the same path name chain more than once. */
+
+struct owner_run
+{
+  ULONG start;
+  ULONG count;
+  const char *what;
+  const char *path;
+};
+
+static struct owner_run *owner_vec;
+static ULONG owner_count;
+static ULONG owner_alloc;
+static const path_chain *owner_last_chain;
+static const char *owner_last_path;
+static char diff_owner;
+static char diff_owner_going;
+
+
+/* Record that COUNT sectors starting at sector START are used for
+   WHAT by the object whose path name chain is pointed to by PATH.
+   PATH is NULL for sectors not used by a file or directory.  This
+   function is called by do_hpfs() and do_fat() for `diff -e'.  START
+   must not decrease between calls. */
+
+void owner_sectors (ULONG start, ULONG count, const char *what,
+                    const path_chain *path)
+{
+  const char *s;
+  char *t;
+
+  if (count == 0)
+    return;
+  if (path != owner_last_chain)
+    {
+      s = format_path_chain (path, NULL);
+      t = xmalloc (strlen (s) + 1);
+      strcpy (t, s);
+      owner_last_chain = path; owner_last_path = t;
+    }
+  if (owner_count >= owner_alloc)
+    {
+      owner_alloc = owner_alloc == 0 ? 1024 : 2 * owner_alloc;
+      owner_vec = realloc (owner_vec, owner_alloc * sizeof (*owner_vec));
+      if (owner_vec == NULL)
+        error ("Out of memory");
+    }
+  owner_vec[owner_count].start = start;
+  owner_vec[owner_count].count = count;
+  owner_vec[owner_count].what = what;
+  owner_vec[owner_count].path = owner_last_path;
+  ++owner_count;
+}
+
+
+/* Walk the file system of the newer source D of `diff -e' to build
+   owner_vec. */
+
+static void owner_build (DISKIO *d)
+{
+  a_owner = TRUE;
+  do_disk (d);
+  a_owner = FALSE;
+  diff_owner = TRUE;
+}
+
+
+/* Show COUNT sectors starting at sector START of the `diff -e'
+   action, one line per type and owner of the sectors. */
+
+static void diff_owner_list (ULONG start, ULONG count)
+{
+  ULONG lo, hi, mid, n;
+  const struct owner_run *p;
+  char buf[40];
+
+  if (!diff_owner_going)
+    {
+      info ("%s\n", list_msg);
+      diff_owner_going = TRUE;
+    }
+
+  /* Find the first run which does not end before START. */
+
+  lo = 0; hi = owner_count;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (owner_vec[mid].start + owner_vec[mid].count <= start)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  while (count != 0)
+    {
+      p = lo < owner_count ? &owner_vec[lo] : NULL;
+      if (p != NULL && p->start <= start)
+        n = MIN (count, p->start + p->count - start);
+      else if (p != NULL)
+        n = MIN (count, p->start - start);
+      else
+        n = count;
+      if (n == 1)
+        my_sprintf (buf, "#%lu", start);
+      else
+        my_sprintf (buf, "#%lu-#%lu", start, start + n - 1);
+      if (p == NULL || p->start > start)
+        info ("  %-24s unused\n", buf);
+      else if (p->path == NULL)
+        info ("  %-24s %s\n", buf, p->what);
+      else
+        info ("  %-24s %s of \"%s\"\n", buf, p->what, p->path);
+      start += n; count -= n;
+      if (p != NULL && start >= p->start + p->count)
+        ++lo;
+    }
+}
+
+
+/* List the pending range of sectors of the `diff' action. */
+
+static void diff_list_flush (void)
+{
+  if (diff_range_count == 0)
+    return;
+  if (diff_owner)
+    diff_owner_list (diff_range_start, diff_range_count);
+  else if (diff_range_count == 1)
+    list ("#%lu", diff_range_start);
+  else
+    list ("#%lu-#%lu", diff_range_start,
+          diff_range_start + diff_range_count - 1);
+  if (diff_map)
+    save_map_sectors (diff_range_start, diff_range_count);
+  diff_sector_total += diff_range_count;
+  ++diff_range_total;
+  diff_range_count = 0;
+}
+
+
+/* Add COUNT sectors starting at sector START to the current list of
+   the `diff' action.  Consecutive sectors are merged into ranges,
+   therefore START must not decrease between calls. */
+
+static void diff_list (ULONG start, ULONG count)
+{
+  if (diff_range_count != 0 && start == diff_range_start + diff_range_count)
+    diff_range_count += count;
+  else
+    {
+      diff_list_flush ();
+      diff_range_start = start;
+      diff_range_count = count;
+    }
+}
+
+
+/* End a list of the `diff' action started with list_start() and show
+   the number of sectors and ranges listed. */
+
+static void diff_list_end (void)
+{
+  diff_list_flush ();
+  list_end ();
+  if (diff_range_total != 0)
+    info ("  (%lu sector%s in %lu range%s)\n",
+          diff_sector_total, diff_sector_total == 1 ? "" : "s",
+          diff_range_total, diff_range_total == 1 ? "" : "s");
+  diff_sector_total = 0; diff_range_total = 0;
+  diff_owner_going = FALSE;
+}
+
+
+/* Compare the sectors which are in both snapshot files D1 and D2. */
+
+static void diff_snapshots (DISKIO *d1, DISKIO *d2)
+{
+  ULONG *p;
+  ULONG i, n;
+
+  list_start ("Differing sectors:");
+  p = diskio_snapshot_compare (d1, d2, &n);
+  for (i = 0; i < n; ++i)
+    diff_list (p[i], 1);
+  free (p);
+  diff_list_end ();
+}
+
+
+/* Compare the sets of sectors of two snapshot files.  The operation
+   is controlled by WHICH:
         1    list sectors which are in the first file only
         2    list sectors which are in the second file only */
 
-static void diff_sectors (DISKIO *d1, DISKIO *d2,
-                          const ULONG *p1, const ULONG *p2,
+static void diff_sectors (const ULONG *p1, const ULONG *p2,
                           ULONG n1, ULONG n2, int which)
 {
   int cmp;
-  BYTE raw1[512], raw2[512];
 
-  if (which == 0)
-    list_start ("Differing sectors:");
-  else
-    list_start ("Sectors only in file %d:", which);
+  list_start ("Sectors only in file %d:", which);
   while (n1 != 0 || n2 != 0)
     {
       if (n1 == 0)
@@ -980,22 +1426,13 @@ static void diff_sectors (DISKIO *d1, DISKIO *d2,
         cmp = 0;
       switch (which)
         {
-        case 0:                 /* Compare sectors */
-          if (cmp == 0)
-            {
-              read_sec (d1, raw1, *p1, 1, FALSE);
-              read_sec (d2, raw2, *p1, 1, FALSE);
-              if (memcmp (raw1, raw2, 512) != 0)
-                list ("#%lu", *p1);
-            }
-          break;
         case 1:
           if (cmp < 0)
-            list ("#%lu", *p1);
+            diff_list (*p1, 1);
           break;
         case 2:
           if (cmp > 0)
-            list ("#%lu", *p2);
+            diff_list (*p2, 1);
           break;
         }
       if (cmp <= 0)
@@ -1003,7 +1440,22 @@ static void diff_sectors (DISKIO *d1, DISKIO *d2,
       if (cmp >= 0)
         ++p2, --n2;
     }
-  list_end ();
+  diff_list_end ();
+}
+
+
+/* Return the hash algorithm to be used for comparing D1 and D2, at
+   least one of which is a CRC file.  Complain if both are CRC files
+   using different hash algorithms. */
+
+static int crc_compare_hash (DISKIO *d1, DISKIO *d2)
+{
+  if (diskio_type (d1) != DIO_CRC)
+    return diskio_crc_hash (d2);
+  if (diskio_type (d2) == DIO_CRC
+      && diskio_crc_hash (d1) != diskio_crc_hash (d2))
+    error ("The CRC files use different hash algorithms");
+  return diskio_crc_hash (d1);
 }
 
 
@@ -1014,217 +1466,1344 @@ static void diff_sectors (DISKIO *d1, DISKIO *d2,
 static void compare_sectors_array (DISKIO *d1, DISKIO *d2, ULONG *array,
                                    ULONG n)
 {
-  BYTE raw1[512], raw2[512];
-  int ok1, ok2;
-  ULONG idx, secno, n1, n2;
-  crc_t crc1, crc2;
+  BYTE *diff;
+  int ok1, ok2, alg;
+  ULONG idx, secno, n1, n2, run, k;
+  hash_t crc1, crc2;
 
   list_start ("Differing sectors:");
   n1 = diskio_total_sectors (d1); n2 = diskio_total_sectors (d2);
   if (diskio_type (d1) == DIO_CRC || diskio_type (d2) == DIO_CRC)
     {
+      alg = crc_compare_hash (d1, d2);
       for (idx = 0; idx < n; ++idx)
         {
           secno = array[idx];
           if ((n1 != 0 && secno >= n1) || (n2 != 0 && secno >= n2))
             break;
-          ok1 = crc_sec (d1, &crc1, secno);
-          ok2 = crc_sec (d2, &crc2, secno);
+          ok1 = crc_sec (d1, &crc1, secno, alg);
+          ok2 = crc_sec (d2, &crc2, secno, alg);
           if (ok1 && ok2 && crc1 != crc2)
-            list ("#%lu", secno);
+            diff_list (secno, 1);
         }
     }
   else
     {
-      for (idx = 0; idx < n; ++idx)
+      /* Compare runs of consecutive sector numbers with large
+         reads. */
+
+      diff = xmalloc (DIFF_CHUNK);
+      idx = 0;
+      while (idx < n)
         {
           secno = array[idx];
           if ((n1 != 0 && secno >= n1) || (n2 != 0 && secno >= n2))
             break;
-          read_sec (d1, raw1, secno, 1, FALSE);
-          read_sec (d2, raw2, secno, 1, FALSE);
-          if (memcmp (raw1, raw2, 512) != 0)
-            list ("#%lu", secno);
+          run = 1;
+          while (idx + run < n && run < DIFF_CHUNK
+                 && array[idx+run] == secno + run)
+            ++run;
+          if (n1 != 0 && secno + run > n1)
+            run = n1 - secno;
+          if (n2 != 0 && secno + run > n2)
+            run = n2 - secno;
+          diskio_compare_sectors (d1, d2, secno, run, diff, threads);
+          for (k = 0; k < run; ++k)
+            if (diff[k])
+              diff_list (secno + k, 1);
+          idx += run;
         }
+      free (diff);
     }
-  list_end ();
+  diff_list_end ();
   if (idx < n)
     {
       list_start ("Missing sectors in source %d:", n1 == 0 ? 2 : 1);
       for (; idx < n; ++idx)
-        list ("#%lu", array[idx]);
-      list_end ();
+        diff_list (array[idx], 1);
+      diff_list_end ();
     }
 }
 
 
-/* Compare all sectors of two disks, two CRC files, or a disk and a
-   CRC file. */
+/* Find the first index in START through END-1 at which the CRC
+   vectors V1 and V2 differ.  Return that index and store the number
+   of consecutive differing CRCs to *PCOUNT.  Return END if there is
+   no difference.  Equal CRCs are skipped in blocks with memcmp(). */
 
-static void compare_sectors_all (DISKIO *d1, DISKIO *d2)
+static ULONG crc_diff_range (const hash_t *v1, const hash_t *v2,
+                             ULONG start, ULONG end, ULONG *pcount)
 {
-  BYTE raw1[512], raw2[512];
-  crc_t crc1, crc2;
-  int ok1, ok2;
-  ULONG secno, n, n1, n2;
+  ULONG i, n;
 
-  list_start ("Differing sectors:");
-  n1 = diskio_total_sectors (d1); n2 = diskio_total_sectors (d2);
-  n = MIN (n1, n2);
-  if (diskio_type (d1) == DIO_CRC || diskio_type (d2) == DIO_CRC)
+  i = start;
+  while (i < end)
     {
-      if (diskio_type (d1) == DIO_CRC && diskio_type (d2) == DIO_CRC)
-        diskio_crc_load (d1);
-      for (secno = 0; secno < n; ++secno)
-        {
-          ok1 = crc_sec (d1, &crc1, secno);
-          ok2 = crc_sec (d2, &crc2, secno);
-          if (ok1 && ok2 && crc1 != crc2)
-            list ("#%lu", secno);
-        }
+      n = MIN (end - i, CRC_CMP_BLOCK);
+      if (memcmp (v1 + i, v2 + i, n * sizeof (hash_t)) != 0)
+        break;
+      i += n;
     }
-  else
-    {
-      for (secno = 0; secno < n; ++secno)
+  while (i < end && v1[i] == v2[i])
+    ++i;
+  for (n = i; n < end && v1[n] != v2[n]; ++n)
+    ;
+  *pcount = n - i;
+  return i;
+}
+
+
+/* List the sectors of block number B of BLOCK sectors, for a disk of
+   N sectors. */
+
+static void list_crc_block (ULONG b, ULONG block, ULONG n)
+{
+  diff_list (b * block, MIN (block, n - b * block));
+}
+
+
+/* Compare the COUNT nodes starting at index FIRST of level LEVEL of
+   the trees of the CRC files D1 and D2 (which have the same geometry).
+   Descend into differing nodes only, list differing leaf blocks. */
+
+static void diff_crc_tree (DISKIO *d1, DISKIO *d2, ULONG level, ULONG first,
+                           ULONG count)
+{
+  hash_t v1[CRC_MAX_FANOUT], v2[CRC_MAX_FANOUT];
+  ULONG i, k, block, fanout, levels, child;
+
+  diskio_crc_geometry (d1, &block, &fanout, &levels);
+  diskio_crc_read (d1, level, first, count, v1);
+  diskio_crc_read (d2, level, first, count, v2);
+  i = 0;
+  while ((i = crc_diff_range (v1, v2, i, count, &k)) < count)
+    for (; k != 0; ++i, --k)
+      if (level == 0)
+        list_crc_block (first + i, block, diskio_total_sectors (d1));
+      else
         {
-          read_sec (d1, raw1, secno, 1, FALSE);
-          read_sec (d2, raw2, secno, 1, FALSE);
-          if (memcmp (raw1, raw2, 512) != 0)
-            list ("#%lu", secno);
+          child = (first + i) * fanout;
+          diff_crc_tree (d1, d2, level - 1, child,
+                         MIN (fanout,
+                              diskio_crc_level_count (d1, level - 1) - child));
         }
-    }
-  list_end ();
-  if (n1 > n2)
-    info ("First disk has more sectors than second disk\n");
-  else if (n1 < n2)
-    info ("Second disk has more sectors than first disk\n");
 }
 
 
-/* `diff' action. */
+/* Store the CRCs of COUNT blocks of BLOCK sectors starting at block
+   number B of D to DST.  D is a CRC file having that block size or a
+   disk of which only the first N sectors are used; the CRCs of a disk
+   are computed with the hash algorithm ALG.  If D is a sparse CRC file
+   (BLOCK is 1), it must contain the CRCs of all these sectors. */
 
-static void cmd_diff (int argc, char *argv[])
+static void get_block_crcs (DISKIO *d, hash_t *dst, ULONG b, ULONG count,
+                            ULONG block, ULONG n, int alg)
 {
-  int i;
-  const char *fname1;
-  const char *fname2;
-  DISKIO *d1, *d2;
-  ULONG *sort1, *sort2;
-  ULONG n1, n2;
+  ULONG i;
 
-  i = 1;
-  if (argc - i != 2)
-    usage_diff ();
-  if (argv[i][0] == '-')
-    usage_diff ();
-  info_file = stdout; diag_file = stderr; prog_file = stderr;
-  fname1 = argv[i+0];
-  fname2 = argv[i+1];
-  d1 = diskio_open ((PCSZ)fname1, DIO_DISK | DIO_SNAPSHOT | DIO_CRC, FALSE);
-  d2 = diskio_open ((PCSZ)fname2, DIO_DISK | DIO_SNAPSHOT | DIO_CRC, FALSE);
-  crc_build_table ();
-  if (diskio_access == ACCESS_DASD
-      && (diskio_type (d1) == DIO_CRC || diskio_type (d2) == DIO_CRC))
-    error ("Cannot use the -d option for the `diff' action with CRC files");
-  sort1 = diskio_snapshot_sort (d1);
-  sort2 = diskio_snapshot_sort (d2);
-  if (sort1 != NULL && sort2 != NULL)
+  if (diskio_type (d) == DIO_CRC && diskio_crc_ranges (d, &i) != NULL)
     {
-      n1 = diskio_snapshot_sectors (d1); n2 = diskio_snapshot_sectors (d2);
-      for (i = 0; i <= 2; ++i)
-        diff_sectors (d1, d2, sort1, sort2, n1, n2, i);
+      for (i = 0; i < count; ++i)
+        if (!crc_sec (d, dst + i, b + i, alg))
+          abort ();
     }
-  else if (sort1 != NULL)
-    compare_sectors_array (d1, d2, sort1, diskio_snapshot_sectors (d1));
-  else if (sort2 != NULL)
-    compare_sectors_array (d1, d2, sort2, diskio_snapshot_sectors (d2));
+  else if (diskio_type (d) == DIO_CRC)
+    diskio_crc_read (d, 0, b, count, dst);
   else
-    compare_sectors_all (d1, d2);
-  free (sort1); free (sort2);
-  diskio_close (d1);
-  diskio_close (d2);
+    diskio_crc_sectors (d, dst, b * block, MIN (count * block, n - b * block),
+                        block, alg, threads);
 }
 
 
-/* `save' action. */
+/* Compare the first N sectors of D1 and D2 block by block.  At least
+   one of D1 and D2 is a CRC file with BLOCK sectors per block, the
+   other one is a disk or a CRC file having the same block size.  ALG
+   is the hash algorithm of the CRC files. */
 
-static void cmd_save (int argc, char *argv[])
+static void diff_crc_blocks (DISKIO *d1, DISKIO *d2, ULONG n, ULONG block,
+                             int alg)
 {
-  DISKIO *d;
-  int i;
+  hash_t *v1, *v2;
+  ULONG b, blocks, count, i, k;
+
+  /* Don't compare a partial block unless it's the last block of both
+     sources. */
+
+  if (diskio_total_sectors (d1) == diskio_total_sectors (d2))
+    blocks = DIVIDE_UP (n, block);
+  else
+    blocks = n / block;
+  v1 = xmalloc (CRC_FILE_CHUNK * sizeof (hash_t));
+  v2 = xmalloc (CRC_FILE_CHUNK * sizeof (hash_t));
+  for (b = 0; b < blocks; b += count)
+    {
+      count = MIN (blocks - b, CRC_FILE_CHUNK);
+      get_block_crcs (d1, v1, b, count, block, n, alg);
+      get_block_crcs (d2, v2, b, count, block, n, alg);
+      i = 0;
+      while ((i = crc_diff_range (v1, v2, i, count, &k)) < count)
+        for (; k != 0; ++i, --k)
+          list_crc_block (b + i, block, n);
+    }
+  free (v1);
+  free (v2);
+}
+
+
+/* Return the number of sectors per block of D if D is a CRC file.
+   Return 0 otherwise. */
+
+static ULONG crc_block_size (DISKIO *d)
+{
+  ULONG block, fanout, levels;
+
+  if (diskio_type (d) != DIO_CRC)
+    return 0;
+  diskio_crc_geometry (d, &block, &fanout, &levels);
+  return block;
+}
+
+
+/* Check whether sector SECNO is in one of the COUNT sorted ranges R
+   (see diskio_crc_ranges()).  *PI is the index of the range to start
+   searching at, it is updated; SECNO must not decrease between calls.
+   Store to *PEND the number of the first sector after SECNO for which
+   the result differs or N, whichever comes first. */
+
+static int in_ranges (const ULONG *r, ULONG count, ULONG *pi, ULONG secno,
+                      ULONG n, ULONG *pend)
+{
+  while (*pi < count && r[2 * *pi] + r[2 * *pi + 1] <= secno)
+    ++*pi;
+  if (*pi >= count)
+    {
+      *pend = n;
+      return FALSE;
+    }
+  if (secno < r[2 * *pi])
+    {
+      *pend = MIN (r[2 * *pi], n);
+      return FALSE;
+    }
+  *pend = MIN (r[2 * *pi] + r[2 * *pi + 1], n);
+  return TRUE;
+}
+
+
+/* Compare the first N sectors of D1 and D2, at least one of which is
+   a sparse CRC file.  The other one is a disk, a CRC file containing
+   one CRC per sector, or a sparse CRC file.  R1 and R2 point to the
+   ranges of D1 and D2 (C1 and C2 ranges), a null pointer for a source
+   which is not sparse.  Only sectors present in both sources are
+   compared.  WHICH has the same meaning as for diff_sectors().  ALG
+   is the hash algorithm of the CRC files.  The caller starts and ends
+   the list. */
+
+static void diff_crc_sparse (DISKIO *d1, DISKIO *d2, ULONG n,
+                             const ULONG *r1, ULONG c1,
+                             const ULONG *r2, ULONG c2, int which, int alg)
+{
+  ULONG all[2], secno, end, e1, e2, i1, i2, count, i, k;
+  hash_t *v1, *v2;
+  int m1, m2;
+
+  all[0] = 0; all[1] = n;
+  if (r1 == NULL)
+    {
+      r1 = all; c1 = 1;
+    }
+  if (r2 == NULL)
+    {
+      r2 = all; c2 = 1;
+    }
+  v1 = xmalloc (CRC_FILE_CHUNK * sizeof (hash_t));
+  v2 = xmalloc (CRC_FILE_CHUNK * sizeof (hash_t));
+  i1 = i2 = 0;
+  for (secno = 0; secno < n; secno = end)
+    {
+      m1 = in_ranges (r1, c1, &i1, secno, n, &e1);
+      m2 = in_ranges (r2, c2, &i2, secno, n, &e2);
+      end = MIN (e1, e2);
+      if (which == 0 && m1 && m2)
+        for (; secno < end; secno += count)
+          {
+            count = MIN (end - secno, CRC_FILE_CHUNK);
+            get_block_crcs (d1, v1, secno, count, 1, n, alg);
+            get_block_crcs (d2, v2, secno, count, 1, n, alg);
+            i = 0;
+            while ((i = crc_diff_range (v1, v2, i, count, &k)) < count)
+              {
+                diff_list (secno + i, k);
+                i += k;
+              }
+          }
+      else if ((which == 1 && m1 && !m2) || (which == 2 && !m1 && m2))
+        diff_list (secno, end - secno);
+    }
+  free (v1);
+  free (v2);
+}
+
+
+/* Compare all sectors of two disks, two CRC files, or a disk and a
+   CRC file. */
+
+static void compare_sectors_all (DISKIO *d1, DISKIO *d2)
+{
+  BYTE *diff;
+  const hash_t *v1, *v2;
+  const ULONG *r1, *r2;
+  ULONG secno, n, n1, n2, count, b1, b2, f1, f2, levels, c1, c2, k;
+  int i, alg;
+
+  list_start ("Differing sectors:");
+  n1 = diskio_total_sectors (d1); n2 = diskio_total_sectors (d2);
+  n = MIN (n1, n2);
+  b1 = crc_block_size (d1); b2 = crc_block_size (d2);
+  alg = HASH_CRC32;
+  if (b1 != 0 || b2 != 0)
+    alg = crc_compare_hash (d1, d2);
+  r1 = r2 = NULL; c1 = c2 = 0;
+  if (b1 != 0)
+    r1 = diskio_crc_ranges (d1, &c1);
+  if (b2 != 0)
+    r2 = diskio_crc_ranges (d2, &c2);
+  if (r1 != NULL || r2 != NULL)
+    {
+      /* A sparse CRC file contains one CRC per sector. */
+
+      if (b1 > 1 || b2 > 1)
+        error ("The CRC files have different block sizes");
+      diff_crc_sparse (d1, d2, n, r1, c1, r2, c2, 0, alg);
+    }
+  else if (b1 != 0 && b2 != 0)
+    {
+      diskio_crc_geometry (d1, &b1, &f1, &levels);
+      diskio_crc_geometry (d2, &b2, &f2, &levels);
+      if (b1 != b2)
+        error ("The CRC files have different block sizes");
+      v1 = v2 = NULL;
+      if (f1 != 0 && f1 == f2 && n1 == n2)
+        {
+          /* Walk the trees, skipping identical subtrees. */
+
+          diff_crc_tree (d1, d2, levels - 1, 0, 1);
+        }
+      else if (b1 == 1)
+        {
+          /* Compare the CRC vectors. */
+
+          diskio_crc_load (d1); diskio_crc_load (d2);
+          v1 = diskio_crc_vector (d1); v2 = diskio_crc_vector (d2);
+          if (v1 == NULL || v2 == NULL)
+            diff_crc_blocks (d1, d2, n, 1, alg);
+          else
+            {
+              secno = 0;
+              while ((secno = crc_diff_range (v1, v2, secno, n, &count)) < n)
+                {
+                  diff_list (secno, count);
+                  secno += count;
+                }
+            }
+        }
+      else
+        diff_crc_blocks (d1, d2, n, b1, alg);
+    }
+  else if (b1 != 0 || b2 != 0)
+    diff_crc_blocks (d1, d2, n, b1 != 0 ? b1 : b2, alg);
+  else
+    {
+      diff = xmalloc (DIFF_CHUNK);
+      for (secno = 0; secno < n; secno += count)
+        {
+          count = MIN (n - secno, DIFF_CHUNK);
+          diskio_compare_sectors (d1, d2, secno, count, diff, threads);
+          for (k = 0; k < count; ++k)
+            if (diff[k])
+              diff_list (secno + k, 1);
+        }
+      free (diff);
+    }
+  diff_list_end ();
+
+  /* List the sectors present in only one of two sparse CRC files. */
+
+  if (r1 != NULL && r2 != NULL)
+    for (i = 1; i <= 2; ++i)
+      {
+        list_start ("Sectors only in file %d:", i);
+        diff_crc_sparse (d1, d2, n, r1, c1, r2, c2, i, alg);
+        diff_list_end ();
+      }
+  if (n1 > n2)
+    info ("First disk has more sectors than second disk\n");
+  else if (n1 < n2)
+    info ("Second disk has more sectors than first disk\n");
+}
+
+
+/* Set the number of threads from the argument S of the -j option.
+   Return FALSE if S is invalid. */
+
+static int parse_threads (const char *s)
+{
+  ULONG n;
+  char *e;
+
+  errno = 0;
+  n = strtoul (s, &e, 10);
+  if (errno != 0 || e == s || *e != 0 || n < 1 || n > 16)
+    return FALSE;
+  threads = (int)n;
+  return TRUE;
+}
+
+
+/* One source of the `diff' action with more than two sources. */
+
+struct diff_source
+{
+  const char *fname;            /* Name of the source */
+  DISKIO *d;                    /* The source */
+  ULONG total;                  /* Total number of sectors */
+  ULONG *sorted;                /* Sorted sector numbers (snapshot file) */
+  ULONG sorted_count;           /* Number of entries of `sorted' */
+  ULONG sorted_next;            /* Next entry of `sorted' to look at */
+  BYTE *data;                   /* Sector data (disk or snapshot file) */
+  hash_t *hash;                 /* CRCs of the sectors */
+  BYTE present[DIFF_MULTI_CHUNK]; /* Non-zero if the sector is present */
+};
+
+/* Pending row of the change matrix of diff_multi(): COUNT sectors
+   starting at START with the letters PATTERN.  The sources are
+   listed before the first row. */
+
+static ULONG matrix_start;
+static ULONG matrix_count;
+static char matrix_pattern[2 * DIFF_MAX_SOURCES + 1];
+static const struct diff_source *matrix_src;
+static int matrix_src_count;
+
+
+/* Show the pending row of the change matrix. */
+
+static void diff_matrix_flush (void)
+{
+  char buf[40];
+  int i;
+
+  if (matrix_count == 0)
+    return;
+  if (diff_range_total == 0)
+    {
+      for (i = 0; i < matrix_src_count; ++i)
+        info ("File %d: %s\n", i + 1, matrix_src[i].fname);
+      info ("%-24s", "Differing sectors:");
+      for (i = 0; i < matrix_src_count; ++i)
+        info (" %d", i + 1);
+      info ("\n");
+    }
+  if (matrix_count == 1)
+    my_sprintf (buf, "#%lu", matrix_start);
+  else
+    my_sprintf (buf, "#%lu-#%lu", matrix_start,
+                matrix_start + matrix_count - 1);
+  info ("  %-22s%s\n", buf, matrix_pattern);
+  if (diff_map)
+    save_map_sectors (matrix_start, matrix_count);
+  diff_sector_total += matrix_count;
+  ++diff_range_total;
+  matrix_count = 0;
+}
+
+
+/* Add sector SECNO with the letters PATTERN to the change matrix.
+   Consecutive sectors having the same letters are merged. */
+
+static void diff_matrix_row (ULONG secno, const char *pattern)
+{
+  if (matrix_count != 0 && secno == matrix_start + matrix_count
+      && strcmp (pattern, matrix_pattern) == 0)
+    ++matrix_count;
+  else
+    {
+      diff_matrix_flush ();
+      matrix_start = secno;
+      matrix_count = 1;
+      strcpy (matrix_pattern, pattern);
+    }
+}
+
+
+/* Compare the N sources SRC (disks, snapshot files, and CRC files
+   containing one CRC per sector) in one pass.  Every sector present in
+   at least two sources is compared, each source is read once.  For
+   each sector for which the sources don't agree, show a row of the
+   change matrix: one letter per source, sources having the same letter
+   agree on the contents of the sector, `-' marks a source not
+   containing the sector.  Sectors of disks and snapshot files are
+   compared by contents, sectors of CRC files by CRC. */
+
+static void diff_multi (struct diff_source *src, int n)
+{
+  ULONG secno, end, k, run, total;
+  int i, j, alg, use_hash, labels;
+  char label[DIFF_MAX_SOURCES];
+  char pattern[2 * DIFF_MAX_SOURCES + 1];
+  BYTE need[DIFF_MULTI_CHUNK];
+
+  /* If there are CRC files, the sectors of the other sources are
+     compared by their CRCs. */
+
+  alg = HASH_CRC32; use_hash = FALSE;
+  for (i = 0; i < n; ++i)
+    if (diskio_type (src[i].d) == DIO_CRC)
+      {
+        if (use_hash && diskio_crc_hash (src[i].d) != alg)
+          error ("The CRC files use different hash algorithms");
+        alg = diskio_crc_hash (src[i].d);
+        use_hash = TRUE;
+      }
+
+  total = 0;
+  for (i = 0; i < n; ++i)
+    {
+      total = MAX (total, src[i].total);
+      src[i].data = NULL;
+      if (diskio_type (src[i].d) != DIO_CRC)
+        src[i].data = xmalloc (DIFF_MULTI_CHUNK * 512);
+      src[i].hash = xmalloc (DIFF_MULTI_CHUNK * sizeof (hash_t));
+    }
+
+  matrix_src = src; matrix_src_count = n;
+  for (secno = 0; secno < total; secno = end)
+    {
+      end = secno + MIN (total - secno, DIFF_MULTI_CHUNK);
+
+      /* Find out which sectors are present in which source. */
+
+      memset (need, 0, sizeof (need));
+      for (i = 0; i < n; ++i)
+        for (k = 0; k < end - secno; ++k)
+          {
+            if (src[i].sorted != NULL)
+              {
+                while (src[i].sorted_next < src[i].sorted_count
+                       && src[i].sorted[src[i].sorted_next] < secno + k)
+                  ++src[i].sorted_next;
+                src[i].present[k]
+                  = (src[i].sorted_next < src[i].sorted_count
+                     && src[i].sorted[src[i].sorted_next] == secno + k);
+              }
+            else if (src[i].data == NULL)
+              src[i].present[k] = (BYTE)crc_sec (src[i].d, &src[i].hash[k],
+                                                 secno + k, alg);
+            else
+              src[i].present[k] = (secno + k < src[i].total);
+            if (src[i].present[k])
+              ++need[k];
+          }
+
+      /* Read the sectors present in at least two sources. */
+
+      for (i = 0; i < n; ++i)
+        if (src[i].data != NULL)
+          for (k = 0; k < end - secno; k += run)
+            {
+              run = 1;
+              if (!src[i].present[k] || need[k] < 2)
+                continue;
+              while (k + run < end - secno && src[i].present[k+run]
+                     && need[k+run] >= 2)
+                ++run;
+              read_sec (src[i].d, src[i].data + k * 512, secno + k, run,
+                        FALSE);
+              if (use_hash)
+                for (j = 0; (ULONG)j < run; ++j)
+                  src[i].hash[k+j] = hash_compute (alg, src[i].data
+                                                   + (k + j) * 512, 512);
+            }
+
+      /* Assign the letters. */
+
+      for (k = 0; k < end - secno; ++k)
+        {
+          if (need[k] < 2)
+            continue;
+          labels = 0;
+          for (i = 0; i < n; ++i)
+            {
+              label[i] = '-';
+              if (!src[i].present[k])
+                continue;
+              for (j = 0; j < i; ++j)
+                if (src[j].present[k]
+                    && (src[i].data != NULL && src[j].data != NULL
+                        ? memcmp (src[i].data + k * 512,
+                                  src[j].data + k * 512, 512) == 0
+                        : src[i].hash[k] == src[j].hash[k]))
+                  break;
+              if (j < i)
+                label[i] = label[j];
+              else
+                label[i] = (char)('A' + labels++);
+            }
+          if (labels >= 2)
+            {
+              for (i = 0; i < n; ++i)
+                {
+                  pattern[2*i+0] = ' ';
+                  pattern[2*i+1] = label[i];
+                }
+              pattern[2*n] = 0;
+              diff_matrix_row (secno + k, pattern);
+            }
+        }
+    }
+  diff_matrix_flush ();
+  diff_list_end ();
+  for (i = 0; i < n; ++i)
+    {
+      free (src[i].data);
+      free (src[i].hash);
+    }
+}
+
+
+/* Return the number of sectors of the source D of the `diff' action.
+   SORTED is the sorted array of sector numbers if D is a snapshot
+   file, for which the number of sectors of the disk is not known in
+   all cases. */
+
+static ULONG diff_total (DISKIO *d, const ULONG *sorted)
+{
+  ULONG n;
+
+  n = diskio_total_sectors (d);
+  if (sorted != NULL && diskio_snapshot_sectors (d) != 0)
+    n = MAX (n, sorted[diskio_snapshot_sectors (d) - 1] + 1);
+  return n;
+}
+
+
+/* `diff' action. */
+
+static void cmd_diff (int argc, char *argv[])
+{
+  int i;
+  const char *fname1;
+  const char *fname2;
+  DISKIO *d1, *d2;
+  ULONG *sort1, *sort2, *ranges;
+  ULONG n1, n2, total, count;
+  struct diff_source src[DIFF_MAX_SOURCES];
+  char **names;
+  int j, n, owner;
+
+  i = 1; owner = FALSE;
+  while (i < argc && argv[i][0] == '-')
+    if (strcmp (argv[i], "-e") == 0)
+      {
+        owner = TRUE; ++i;
+      }
+    else if (strncmp (argv[i], "-j=", 3) == 0 && parse_threads (argv[i] + 3))
+      ++i;
+    else if (strncmp (argv[i], "-o=", 3) == 0 && argv[i][3] != 0)
+      {
+        save_fname = argv[i] + 3; ++i;
+      }
+    else
+      usage_diff ();
+  if (argc - i < 2 || argc - i > DIFF_MAX_SOURCES)
+    usage_diff ();
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  names = argv + i; n = argc - i;
+  if (n > 2 && owner)
+    error ("The -e option of the `diff' action requires two sources");
+  if (n > 2)
+    {
+      /* More than two sources: show a change matrix. */
+
+      total = 0;
+      for (j = 0; j < n; ++j)
+        {
+          src[j].fname = names[j];
+          src[j].d = diskio_open ((PCSZ)names[j],
+                                  DIO_DISK | DIO_SNAPSHOT | DIO_CRC, FALSE);
+          if (diskio_access == ACCESS_DASD
+              && diskio_type (src[j].d) == DIO_CRC)
+            error ("Cannot use the -d option for the `diff' action "
+                   "with CRC files");
+          src[j].sorted = diskio_snapshot_sort (src[j].d);
+          src[j].sorted_count = 0; src[j].sorted_next = 0;
+          if (src[j].sorted != NULL)
+            src[j].sorted_count = diskio_snapshot_sectors (src[j].d);
+          src[j].total = diff_total (src[j].d, src[j].sorted);
+          total = MAX (total, src[j].total);
+        }
+      if (save_fname != NULL)
+        {
+          save_map_create (total);
+          diff_map = TRUE;
+        }
+      diff_multi (src, n);
+      if (diff_map)
+        {
+          diff_map = FALSE;
+          ranges = save_map_ranges (&count);
+          save_map_file (names, n, total, ranges, count);
+          free (ranges);
+        }
+      for (j = 0; j < n; ++j)
+        {
+          free (src[j].sorted);
+          diskio_close (src[j].d);
+        }
+      return;
+    }
+  fname1 = names[0];
+  fname2 = names[1];
+  d1 = diskio_open ((PCSZ)fname1, DIO_DISK | DIO_SNAPSHOT | DIO_CRC, FALSE);
+  d2 = diskio_open ((PCSZ)fname2, DIO_DISK | DIO_SNAPSHOT | DIO_CRC, FALSE);
+  if (diskio_access == ACCESS_DASD
+      && (diskio_type (d1) == DIO_CRC || diskio_type (d2) == DIO_CRC))
+    error ("Cannot use the -d option for the `diff' action with CRC files");
+  sort1 = diskio_snapshot_sort (d1);
+  sort2 = diskio_snapshot_sort (d2);
+  total = MAX (diff_total (d1, sort1), diff_total (d2, sort2));
+  if (owner)
+    {
+      /* Take the usage of the sectors from the newer source, unless
+         it is a CRC file. */
+
+      if (diskio_type (d2) != DIO_CRC)
+        owner_build (d2);
+      else if (diskio_type (d1) != DIO_CRC)
+        owner_build (d1);
+      else
+        error ("The -e option of the `diff' action cannot be used "
+               "with two CRC files");
+    }
+  if (save_fname != NULL)
+    {
+      save_map_create (total);
+      diff_map = TRUE;
+    }
+  if (sort1 != NULL && sort2 != NULL)
+    {
+      n1 = diskio_snapshot_sectors (d1); n2 = diskio_snapshot_sectors (d2);
+      diff_snapshots (d1, d2);
+      for (i = 1; i <= 2; ++i)
+        diff_sectors (sort1, sort2, n1, n2, i);
+    }
+  else if (sort1 != NULL)
+    compare_sectors_array (d1, d2, sort1, diskio_snapshot_sectors (d1));
+  else if (sort2 != NULL)
+    compare_sectors_array (d1, d2, sort2, diskio_snapshot_sectors (d2));
+  else
+    compare_sectors_all (d1, d2);
+  free (sort1); free (sort2);
+  if (diff_map)
+    {
+      diff_map = FALSE;
+      ranges = save_map_ranges (&count);
+      save_map_file (names, 2, total, ranges, count);
+      free (ranges);
+    }
+  diskio_close (d1);
+  diskio_close (d2);
+}
+
+
+/* `save' action. */
+
+static void cmd_save (int argc, char *argv[])
+{
+  DISKIO *d;
+  int i;
   const char *src_fname;
 
+  i = 1; save_base_fname = NULL;
+  while (i < argc)
+    if (strcmp (argv[i], "-v") == 0)
+      {
+        verbose = TRUE; ++i;
+      }
+    else if (strncmp (argv[i], "-b=", 3) == 0)
+      {
+        if (argv[i][3] == 0)
+          usage_save ();
+        save_base_fname = argv[i] + 3;
+        ++i;
+      }
+    else
+      break;
+  if (argc - i != 2)
+    usage_save ();
+  if (argv[i][0] == '-')
+    usage_save ();
+  src_fname = argv[i+0];
+  save_fname = argv[i+1];
+  a_save = TRUE;
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  d = diskio_open ((PCSZ)src_fname, DIO_DISK | DIO_SNAPSHOT, FALSE);
+  if (save_base_fname != NULL)
+    save_base = diskio_open ((PCSZ)save_base_fname, DIO_SNAPSHOT, FALSE);
+  save_create (src_fname, SAVE_SNAPSHOT);
+  do_disk (d);
+  diskio_close (d);
+  save_close ();
+  if (save_base != NULL)
+    {
+      diskio_close (save_base);
+      save_base = NULL;
+    }
+}
+
+
+/* Return the number of consecutive sector numbers in the sorted
+   array SORT of N sector numbers, starting at index IDX.  Don't
+   return more than MAX. */
+
+static ULONG sorted_run (const ULONG *sort, ULONG idx, ULONG n, ULONG max)
+{
+  ULONG run;
+
+  run = 1;
+  while (idx + run < n && run < max && sort[idx+run] == sort[idx] + run)
+    ++run;
+  return run;
+}
+
+
+/* Show the result of the `restore' action and quit.  BAD is the
+   number of sectors not written. */
+
+static void restore_quit (ULONG bad)
+{
+  if (bad == 0)
+    {
+      fprintf (prog_file, "Done\n");
+      quit (0, FALSE);
+    }
+  else if (bad == 1)
+    {
+      fprintf (prog_file, "Done, 1 sector not written\n");
+      quit (2, FALSE);
+    }
+  else
+    {
+      fprintf (prog_file, "Done, %lu sectors not written\n", bad);
+      quit (2, FALSE);
+    }
+}
+
+
+/* `restore' action. */
+
+static void cmd_restore (int argc, char *argv[])
+{
+  DISKIO *d1, *d2;
+  int i, resume, undo, pending, any;
+  const char *dst_fname;
+  const char *src_fname;
+  const char *journal_fname;
+  char temp, all = TRUE, *e;
+  ULONG *sort, idx, sec, bad, n, secno = 0;
+  ULONG run, k, start, written, first;
+  char buf[10];
+  BYTE *data, *old, *written_flag;
+  crc_t *check;
+
+  i = 1; save_fname = NULL; journal_fname = NULL;
+  resume = FALSE; undo = FALSE;
+  while (i < argc)
+    if (strncmp (argv[i], "-s=", 3) == 0)
+      {
+        if (argv[i][3] == 0)
+          usage_restore ();
+        save_fname = argv[i] + 3;
+        ++i;
+      }
+    else if (strncmp (argv[i], "-l=", 3) == 0)
+      {
+        if (argv[i][3] == 0)
+          usage_restore ();
+        journal_fname = argv[i] + 3;
+        ++i;
+      }
+    else if (strcmp (argv[i], "-resume") == 0)
+      {
+        resume = TRUE; ++i;
+      }
+    else if (strcmp (argv[i], "-undo") == 0)
+      {
+        undo = TRUE; ++i;
+      }
+    else
+      break;
+  if ((resume || undo) && journal_fname == NULL)
+    usage_restore ();
+  if ((resume || undo) && save_fname != NULL)
+    usage_restore ();
+  if (resume && undo)
+    usage_restore ();
+
+  if (undo && argc - i == 1)
+    ;
+  else if (!undo && argc - i == 2)
+    {
+      secno = 0; all = TRUE;
+    }
+  else if (!undo && argc - i == 3)
+    {
+      errno = 0;
+      secno = strtoul (argv[i+2], &e, 0);
+      if (errno != 0 || e == argv[i+2] || *e != 0)
+        usage_write ();
+      all = FALSE;
+    }
+  else
+    usage_restore ();
+
+  if (argv[i][0] == '-')
+    usage_restore ();
+  dst_fname = argv[i+0];
+  src_fname = undo ? NULL : argv[i+1];
+
+  printf ("Do you really want to overwrite the file system data "
+          "structures\nof \"%s\" (type \"YES!\" to confirm)? ", dst_fname);
+  fflush (stdout);
+  if (fgets (buf, sizeof (buf), stdin) == NULL)
+    quit (2, FALSE);
+  if (strcmp (buf, "YES!\n") != 0)
+    quit (0, FALSE);
+
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+
+  /* Roll back a restore operation, using the old contents of the
+     sectors recorded in the journal. */
+
+  if (undo)
+    {
+      ignore_lock_error = FALSE; dont_lock = FALSE;
+      d1 = diskio_open ((PCSZ)dst_fname, DIO_DISK | DIO_SNAPSHOT, TRUE);
+      fprintf (prog_file, "Undoing...DO NOT INTERRUPT!...\n");
+      fflush (prog_file);
+      bad = journal_undo (journal_fname, dst_fname, d1);
+      diskio_close (d1);
+      restore_quit (bad);
+    }
+
+  fprintf (prog_file, "Preliminary actions...\n"); fflush (prog_file);
+  temp = write_enable; write_enable = FALSE;
+  ignore_lock_error = FALSE; dont_lock = FALSE;
+  d2 = diskio_open ((PCSZ)src_fname, DIO_SNAPSHOT, FALSE);
+  write_enable = temp;
+  d1 = diskio_open ((PCSZ)dst_fname, DIO_DISK | DIO_SNAPSHOT, TRUE);
+  if (save_fname != NULL)
+    save_create (dst_fname, SAVE_SNAPSHOT);
+
+  /* Set up a sorted list of sectors. */
+
+  if (all)
+    {
+      sort = diskio_snapshot_sort (d2);
+      n = diskio_snapshot_sectors (d2);
+    }
+  else
+    {
+      sort = &secno; n = 1;
+    }
+
+  /* Check the snapshot file. */
+
+  if (diskio_snapshot_verify (d2, threads) != 0)
+    error ("%s is damaged", src_fname);
+
+  data = xmalloc (RESTORE_CHUNK * 512);
+  old = xmalloc (RESTORE_CHUNK * 512);
+
+  /* Make a backup if requested. */
+
+  if (save_fname != NULL)
+    {
+      a_save = TRUE;
+      for (idx = 0; idx < n; idx += run)
+        {
+          run = sorted_run (sort, idx, n, RESTORE_CHUNK);
+          read_sec (d1, old, sort[idx], run, TRUE);
+        }
+      a_save = FALSE;
+      save_close ();
+    }
+
+  /* Create the journal or find the batch at which to continue.  The
+     journal is identified by the list of sectors. */
+
+  first = 0; pending = FALSE;
+  if (journal_fname != NULL)
+    {
+      if (resume)
+        {
+          first = journal_resume (journal_fname, dst_fname, n,
+                                  crc_compute ((const BYTE *)sort,
+                                               n * sizeof (*sort)),
+                                  &pending);
+          if (first < n)
+            fprintf (prog_file, "Continuing at sector #%lu\n", sort[first]);
+        }
+      else
+        journal_create (journal_fname, dst_fname, n,
+                        crc_compute ((const BYTE *)sort, n * sizeof (*sort)));
+    }
+
+  /* Read runs of consecutive sectors from the snapshot file and from
+     the target, and write only the sectors which differ.  Adjacent
+     differing sectors are written with a single call.  Remember the
+     CRCs of the sectors written for verifying them.  With a journal,
+     each run containing differing sectors is a batch: its old
+     contents are recorded before writing. */
+
+  fprintf (prog_file, "Writing...DO NOT INTERRUPT!...\n"); fflush (prog_file);
+  check = xmalloc (n * sizeof (*check));
+  written_flag = xmalloc (n);
+  memset (written_flag, FALSE, n);
+  bad = 0; written = 0;
+  for (idx = first; idx < n; idx += run)
+    {
+      sec = sort[idx];
+      run = sorted_run (sort, idx, n, RESTORE_CHUNK);
+      read_sec (d2, data, sec, run, FALSE);
+      read_sec (d1, old, sec, run, FALSE);
+      any = memcmp (data, old, run * 512) != 0;
+      if (journal_fname != NULL && any && !(pending && idx == first))
+        journal_begin (idx, sec, run, old);
+      k = 0;
+      while (k < run)
+        if (memcmp (data + 512 * k, old + 512 * k, 512) == 0)
+          ++k;
+        else
+          {
+            start = k;
+            do
+              {
+                check[idx+k] = crc_compute (data + 512 * k, 512);
+                written_flag[idx+k] = TRUE;
+                ++k;
+              } while (k < run
+                       && memcmp (data + 512 * k, old + 512 * k, 512) != 0);
+            if (write_sec (d1, data + 512 * start, sec + start, k - start))
+              written += k - start;
+            else
+              {
+                bad += k - start;
+                memset (written_flag + idx + start, FALSE, k - start);
+              }
+          }
+      if (journal_fname != NULL && (any || (pending && idx == first)))
+        journal_done ();
+    }
+  diskio_close (d2);
+  fprintf (prog_file, "%lu of %lu sectors written, %lu already up to date\n",
+           written, n - first, n - first - written - bad);
+
+  /* Read back the sectors written, in runs of consecutive sectors. */
+
+  fprintf (prog_file, "Verifying...\n"); fflush (prog_file);
+  idx = 0;
+  while (idx < n)
+    if (!written_flag[idx])
+      ++idx;
+    else
+      {
+        run = 1;
+        while (idx + run < n && run < RESTORE_CHUNK && written_flag[idx+run]
+               && sort[idx+run] == sort[idx] + run)
+          ++run;
+        read_sec (d1, old, sort[idx], run, FALSE);
+        for (k = 0; k < run; ++k)
+          if (crc_compute (old + 512 * k, 512) != check[idx+k])
+            {
+              warning (1, "Sector #%lu does not match the snapshot file "
+                       "after writing", sort[idx+k]);
+              ++bad;
+            }
+        idx += run;
+      }
+  if (journal_fname != NULL)
+    journal_close (bad == 0);
+  diskio_close (d1);
+  free (check); free (written_flag);
+  free (data); free (old);
+  if (sort != &secno)
+    free (sort);
+  restore_quit (bad);
+}
+
+
+/* Return true iff the current sector of input I1 of the `merge'
+   action is to be taken before the current sector of input I2.  For
+   identical sector numbers, the newer (that is, later) input takes
+   precedence. */
+
+static int merge_before (ULONG * const *sort, const ULONG *idx, int i1, int i2)
+{
+  ULONG s1, s2;
+
+  s1 = sort[i1][idx[i1]]; s2 = sort[i2][idx[i2]];
+  return s1 < s2 || (s1 == s2 && i1 > i2);
+}
+
+
+/* Restore the heap property of the N inputs in HEAP for the `merge'
+   action, starting at element I. */
+
+static void merge_sift (int *heap, int n, int i, ULONG * const *sort,
+                        const ULONG *idx)
+{
+  int c, t;
+
+  for (;;)
+    {
+      c = 2 * i + 1;
+      if (c >= n)
+        break;
+      if (c + 1 < n && merge_before (sort, idx, heap[c+1], heap[c]))
+        ++c;
+      if (!merge_before (sort, idx, heap[c], heap[i]))
+        break;
+      t = heap[i]; heap[i] = heap[c]; heap[c] = t;
+      i = c;
+    }
+}
+
+
+/* `merge' action.  The sorted sector tables of all the source
+   snapshot files are merged with a heap of the current sectors of the
+   sources; the target snapshot file is written in ascending order of
+   sector numbers. */
+
+static void cmd_merge (int argc, char *argv[])
+{
+  DISKIO **d;
+  ULONG **sort, *count, *idx;
+  ULONG sec;
+  int *heap;
+  int i, k, n, top;
+  BYTE data[512];
+
+  i = 1;
+  if (argc - i < 3)
+    usage_merge ();
+  if (argv[i][0] == '-')
+    usage_merge ();
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  save_fname = argv[i];
+  n = argc - i - 1;
+  d = xmalloc (n * sizeof (*d));
+  sort = xmalloc (n * sizeof (*sort));
+  count = xmalloc (n * sizeof (*count));
+  idx = xmalloc (n * sizeof (*idx));
+  heap = xmalloc (n * sizeof (*heap));
+  for (k = 0; k < n; ++k)
+    {
+      d[k] = diskio_open ((PCSZ)argv[i+1+k], DIO_SNAPSHOT, FALSE);
+      sort[k] = diskio_snapshot_sort (d[k]);
+      count[k] = diskio_snapshot_sectors (d[k]);
+      idx[k] = 0;
+    }
+  save_create (argv[i+1], SAVE_SNAPSHOT);
+
+  /* Build the heap of all non-empty inputs. */
+
+  top = 0;
+  for (k = 0; k < n; ++k)
+    if (count[k] != 0)
+      heap[top++] = k;
+  for (k = top / 2 - 1; k >= 0; --k)
+    merge_sift (heap, top, k, sort, idx);
+
+  /* Take the smallest sector number from the newest input having that
+     sector, skip that sector in all other inputs. */
+
+  while (top != 0)
+    {
+      k = heap[0];
+      sec = sort[k][idx[k]];
+      read_sec (d[k], data, sec, 1, FALSE);
+      save_sec (data, sec, 1);
+      while (top != 0 && sort[heap[0]][idx[heap[0]]] == sec)
+        {
+          k = heap[0];
+          if (++idx[k] >= count[k])
+            heap[0] = heap[--top];
+          merge_sift (heap, top, 0, sort, idx);
+        }
+    }
+  save_close ();
+
+  for (k = 0; k < n; ++k)
+    {
+      free (sort[k]);
+      diskio_close (d[k]);
+    }
+  free (heap); free (idx); free (count); free (sort); free (d);
+}
+
+
+/* `export' action: Write the sectors of a snapshot file to a raw image
+   file. */
+
+static void cmd_export (int argc, char *argv[])
+{
+  DISKIO *d;
+  ULONG *sort, n, total, idx, k;
+  BYTE *data;
+  int i;
+
   i = 1;
-  while (i < argc)
-    if (strcmp (argv[i], "-v") == 0)
-      {
-        verbose = TRUE; ++i;
-      }
-    else
-      break;
   if (argc - i != 2)
-    usage_save ();
+    usage_export ();
   if (argv[i][0] == '-')
-    usage_save ();
-  src_fname = argv[i+0];
-  save_fname = argv[i+1];
-  a_save = TRUE;
+    usage_export ();
   info_file = stdout; diag_file = stderr; prog_file = stderr;
-  d = diskio_open ((PCSZ)src_fname, DIO_DISK | DIO_SNAPSHOT, FALSE);
-  save_create (src_fname, SAVE_SNAPSHOT);
-  do_disk (d);
-  diskio_close (d);
+  d = diskio_open ((PCSZ)argv[i+0], DIO_SNAPSHOT, FALSE);
+  sort = diskio_snapshot_sort (d);
+  n = diskio_snapshot_sectors (d);
+  total = snapshot_total (d, sort);
+  save_fname = argv[i+1];
+  save_image_create (argv[i+0], total);
+
+  /* Copy runs of consecutive sectors in ascending order. */
+
+  data = xmalloc (EXPORT_CHUNK * 512);
+  idx = 0;
+  while (idx < n)
+    {
+      k = sorted_run (sort, idx, n, EXPORT_CHUNK);
+      read_sec (d, data, sort[idx], k, FALSE);
+      save_sec (data, sort[idx], k);
+      idx += k;
+    }
   save_close ();
+  info ("%lu sectors of %lu exported\n", n, total);
+  free (data);
+  free (sort);
+  diskio_close (d);
 }
 
 
-/* `restore' action. */
+/* `image' action: Copy the allocated sectors and all the sectors
+   used by the file system to a raw image file. */
 
-static void cmd_restore (int argc, char *argv[])
+static void cmd_image (int argc, char *argv[])
 {
-  DISKIO *d1, *d2;
+  DISKIO *d;
+  ULONG *ranges;
+  ULONG r, secno, end, n, count, range_count, copied;
+  BYTE *data;
   int i;
-  const char *dst_fname;
-  const char *src_fname;
-  char temp, all = TRUE, *e;
-  ULONG *sort, idx, sec, bad, n, secno = 0;
-  char buf[10];
-  BYTE data[512];
 
-  i = 1; save_fname = NULL;
-  while (i < argc)
-    if (strncmp (argv[i], "-s=", 3) == 0)
-      {
-        if (argv[i][3] == 0)
-          usage_restore ();
-        save_fname = argv[i] + 3;
-        ++i;
-      }
-    else
-      break;
+  i = 1;
+  if (argc - i != 2)
+    usage_image ();
+  if (argv[i][0] == '-')
+    usage_image ();
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  d = diskio_open ((PCSZ)argv[i+0], DIO_DISK, FALSE);
+
+  /* Walk the file system, recording the sectors which would be saved
+     by the `save' action and the sectors marked as allocated.  The
+     former are included in case the allocation information is
+     damaged. */
+
+  n = diskio_total_sectors (d);
+  save_map_create (n);
+  a_save = TRUE; a_alloc = TRUE;
+  do_disk (d);
+  a_save = FALSE; a_alloc = FALSE;
+  ranges = save_map_ranges (&range_count);
+
+  /* Copy the ranges in ascending order. */
 
-  if (argc - i == 2)
+  save_fname = argv[i+1];
+  save_image_create (argv[i+0], n);
+  data = xmalloc (IMAGE_CHUNK * 512);
+  copied = 0;
+  for (r = 0; r < range_count; ++r)
     {
-      secno = 0; all = TRUE;
+      end = ranges[2*r+0] + ranges[2*r+1];
+      for (secno = ranges[2*r+0]; secno < end; secno += count)
+        {
+          count = MIN (end - secno, IMAGE_CHUNK);
+          read_sec (d, data, secno, count, FALSE);
+          save_sec (data, secno, count);
+          copied += count;
+        }
     }
-  else if (argc - i == 3)
+  save_close ();
+  info ("%lu sectors of %lu copied\n", copied, n);
+  free (data);
+  free (ranges);
+  diskio_close (d);
+}
+
+
+/* Zero the sectors of the free range START through END-1 of D which
+   are not zero.  DATA and ZERO are buffers of TRIM_CHUNK sectors, ZERO
+   is filled with zeros.  Add the number of sectors written to
+   *PWRITTEN and the number of sectors not written to *PBAD. */
+
+static void trim_range (DISKIO *d, ULONG start, ULONG end, BYTE *data,
+                        const BYTE *zero, ULONG *pwritten, ULONG *pbad)
+{
+  ULONG sec, count, k, first;
+
+  for (sec = start; sec < end; sec += count)
     {
-      errno = 0;
-      secno = strtoul (argv[i+2], &e, 0);
-      if (errno != 0 || e == argv[i+2] || *e != 0)
-        usage_write ();
-      all = FALSE;
+      count = MIN (end - sec, TRIM_CHUNK);
+      read_sec (d, data, sec, count, FALSE);
+      k = 0;
+      while (k < count)
+        if (memcmp (data + 512 * k, zero, 512) == 0)
+          ++k;
+        else
+          {
+            first = k;
+            do
+              {
+                ++k;
+              } while (k < count && memcmp (data + 512 * k, zero, 512) != 0);
+            if (write_sec (d, zero, sec + first, k - first))
+              *pwritten += k - first;
+            else
+              *pbad += k - first;
+          }
     }
-  else
-    usage_restore ();
+}
+
 
+/* `trim' action: Fill the free sectors of a disk with zeros. */
+
+static void cmd_trim (int argc, char *argv[])
+{
+  DISKIO *d;
+  ULONG *ranges;
+  ULONG r, n, start, end, range_count, free_count, written, bad;
+  BYTE *data, *zero;
+  char buf[10];
+  int i;
+
+  i = 1;
+  if (argc - i != 1)
+    usage_trim ();
   if (argv[i][0] == '-')
-    usage_restore ();
-  dst_fname = argv[i+0];
-  src_fname = argv[i+1];
+    usage_trim ();
 
-  printf ("Do you really want to overwrite the file system data "
-          "structures\nof \"%s\" (type \"YES!\" to confirm)? ", dst_fname);
+  printf ("Do you really want to overwrite all the free sectors\n"
+          "of \"%s\" (type \"YES!\" to confirm)? ", argv[i]);
   fflush (stdout);
   if (fgets (buf, sizeof (buf), stdin) == NULL)
     quit (2, FALSE);
@@ -1232,70 +2811,77 @@ static void cmd_restore (int argc, char *argv[])
     quit (0, FALSE);
 
   info_file = stdout; diag_file = stderr; prog_file = stderr;
-  fprintf (prog_file, "Preliminary actions...\n"); fflush (prog_file);
-  temp = write_enable; write_enable = FALSE;
   ignore_lock_error = FALSE; dont_lock = FALSE;
-  d2 = diskio_open ((PCSZ)src_fname, DIO_SNAPSHOT, FALSE);
-  write_enable = temp;
-  d1 = diskio_open ((PCSZ)dst_fname, DIO_DISK | DIO_SNAPSHOT, TRUE);
-  if (save_fname != NULL)
-    save_create (dst_fname, SAVE_SNAPSHOT);
+  d = diskio_open ((PCSZ)argv[i], DIO_DISK, TRUE);
 
-  /* Set up a sorted list of sectors. */
+  /* Walk the file system, recording the sectors marked as allocated
+     or bad and the sectors which would be saved by the `save' action.
+     The latter are included in case the allocation information is
+     damaged.  As the drive stays locked until all sectors have been
+     written, the allocation cannot change in the meantime. */
 
-  if (all)
-    {
-      sort = diskio_snapshot_sort (d2);
-      n = diskio_snapshot_sectors (d2);
-    }
-  else
-    {
-      sort = &secno; n = 1;
-    }
+  n = diskio_total_sectors (d);
+  save_map_create (n);
+  a_save = TRUE; a_alloc = TRUE; a_trim = TRUE;
+  do_disk (d);
+  a_save = FALSE; a_alloc = FALSE; a_trim = FALSE;
+  ranges = save_map_ranges (&range_count);
 
-  /* Check the snapshot file. */
+  /* Don't touch sectors beyond the end of the file system. */
 
-  for (idx = 0; idx < n; ++idx)
-    read_sec (d2, data, sort[idx], 1, FALSE);
+  if (boot_total (d) == 0)
+    error ("Cannot determine the size of the file system");
+  n = MIN (n, boot_total (d));
 
-  /* Make a backup if requested. */
+  /* Zero the gaps between the ranges, writing only the sectors which
+     are not zero already. */
 
-  if (save_fname != NULL)
-    {
-      a_save = TRUE;
-      for (idx = 0; idx < n; ++idx)
-        read_sec (d1, data, sort[idx], 1, TRUE);
-      a_save = FALSE;
-      save_close ();
-    }
   fprintf (prog_file, "Writing...DO NOT INTERRUPT!...\n"); fflush (prog_file);
-  bad = 0;
-  for (idx = 0; idx < n; ++idx)
-    {
-      sec = sort[idx];
-      read_sec (d2, data, sec, 1, FALSE);
-      if (!write_sec (d1, data, sec))
-        ++bad;
-    }
-  diskio_close (d2);
-  diskio_close (d1);
-  if (sort != &secno)
-    free (sort);
-  if (bad == 0)
-    {
-      fprintf (prog_file, "Done\n");
-      quit (0, FALSE);
-    }
-  else if (bad == 1)
+  data = xmalloc (TRIM_CHUNK * 512);
+  zero = xmalloc (TRIM_CHUNK * 512);
+  memset (zero, 0, TRIM_CHUNK * 512);
+  start = 0; free_count = 0; written = 0; bad = 0;
+  for (r = 0; r < range_count && start < n; ++r)
     {
-      fprintf (prog_file, "Done, 1 sector not written\n");
-      quit (2, FALSE);
+      end = MIN (ranges[2*r+0], n);
+      free_count += end - start;
+      trim_range (d, start, end, data, zero, &written, &bad);
+      start = ranges[2*r+0] + ranges[2*r+1];
     }
-  else
+  if (start < n)
     {
-      fprintf (prog_file, "Done, %lu sectors not written\n", bad);
-      quit (2, FALSE);
+      free_count += n - start;
+      trim_range (d, start, n, data, zero, &written, &bad);
     }
+  fprintf (prog_file, "%lu of %lu free sectors written, %lu already zero\n",
+           written, free_count, free_count - written - bad);
+  free (zero); free (data); free (ranges);
+  diskio_close (d);
+  restore_quit (bad);
+}
+
+
+/* `verify' action: Check the integrity of a snapshot file. */
+
+static void cmd_verify (int argc, char *argv[])
+{
+  DISKIO *d;
+  int i;
+
+  i = 1;
+  while (i < argc && argv[i][0] == '-')
+    if (strncmp (argv[i], "-j=", 3) == 0 && parse_threads (argv[i] + 3))
+      ++i;
+    else
+      usage_verify ();
+  if (argc - i != 1)
+    usage_verify ();
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  d = diskio_open ((PCSZ)argv[i], DIO_SNAPSHOT, FALSE);
+  if (diskio_snapshot_verify (d, threads) == 0)
+    info ("%s is OK\n", argv[i]);
+  diskio_close (d);
+  quit (0, TRUE);
 }
 
 
@@ -1350,33 +2936,78 @@ static void cmd_dir (int argc, char *argv[])
 }
 
 
+/* `treediff' action. */
+
+static void cmd_treediff (int argc, char *argv[])
+{
+  DISKIO *d1, *d2;
+  int i;
+
+  i = 1;
+  if (argc - i != 2)
+    usage_treediff ();
+  if (argv[i][0] == '-')
+    usage_treediff ();
+  info_file = stdout; diag_file = stderr; prog_file = stderr;
+  d1 = diskio_open ((PCSZ)argv[i+0], DIO_DISK | DIO_SNAPSHOT, FALSE);
+  d2 = diskio_open ((PCSZ)argv[i+1], DIO_DISK | DIO_SNAPSHOT, FALSE);
+  treediff_hpfs (d1, d2, argv[i+0], argv[i+1]);
+  diskio_close (d1);
+  diskio_close (d2);
+}
+
+
 /* `read' action. */
 
 static void cmd_read (int argc, char *argv[])
 {
   DISKIO *d;
   int i;
-  ULONG n;
+  ULONG n, count, k;
   const char *src_fname;
   char *e;
-  char data[512];
+  BYTE *data;
 
   i = 1;
-  if (argc - i != 3)
+  if (argc - i != 3 && argc - i != 4)
     usage_read ();
   if (argv[i][0] == '-')
     usage_read ();
   info_file = stdout; diag_file = stderr; prog_file = stderr;
   src_fname = argv[i+0];
   save_fname = argv[i+1];
+  if (strcmp (save_fname, "-") == 0)
+    {
+      /* Keep the messages out of the data written to standard
+         output. */
+
+      info_file = stderr; total_file = stderr;
+    }
   d = diskio_open ((PCSZ)src_fname, DIO_DISK | DIO_SNAPSHOT, FALSE);
   errno = 0;
   n = strtoul (argv[i+2], &e, 0);
   if (errno != 0 || e == argv[i+2] || *e != 0)
     usage_read ();
+  count = 1;
+  if (argc - i == 4)
+    {
+      errno = 0;
+      count = strtoul (argv[i+3], &e, 0);
+      if (errno != 0 || e == argv[i+3] || *e != 0 || count == 0)
+        usage_read ();
+      if (n + count < n)
+        error ("Invalid sector range");
+    }
   save_create (src_fname, SAVE_RAW);
-  read_sec (d, data, n, 1, FALSE);
-  fwrite (data, 512, 1, save_file);
+  data = xmalloc (READ_WRITE_CHUNK * 512);
+  for (; count != 0; n += k, count -= k)
+    {
+      k = MIN (count, READ_WRITE_CHUNK);
+      read_sec (d, data, n, k, FALSE);
+      if (fwrite (data, 512, k, save_file) != k)
+        save_error ();
+    }
+  free (data);
   save_close ();
   diskio_close (d);
 }
@@ -1389,11 +3020,12 @@ static void cmd_write (int argc, char *argv[])
   DISKIO *d;
   int i, ok;
   size_t nread;
-  ULONG n;
+  ULONG n, k;
+  long size;
   const char *dst_fname;
   const char *src_fname;
   char *e;
-  char data[512+1];             /* Extra byte for checking the file length */
+  BYTE *data;
   FILE *f;
 
   i = 1;
@@ -1410,23 +3042,138 @@ static void cmd_write (int argc, char *argv[])
   if (errno != 0 || e == argv[i+2] || *e != 0)
     usage_write ();
 
-  f = fopen (src_fname, "rb");
-  if (f == NULL)
-    error ("%s: %s", src_fname, strerror (errno));
-  nread = fread (data, 1, sizeof (data), f);
-  if (nread == 0)
-    error ("%s: %s", src_fname, strerror (errno));
-  fclose (f);
-  if (nread != 512)
-    error ("The source file must contain exactly 512 bytes");
+  /* Check the length of the source file before writing anything.
+     The length of standard input is checked chunk by chunk. */
+
+  if (strcmp (src_fname, "-") == 0)
+    {
+      f = stdin;
+      setmode (fileno (stdin), O_BINARY);
+    }
+  else
+    {
+      f = fopen (src_fname, "rb");
+      if (f == NULL)
+        error ("%s: %s", src_fname, strerror (errno));
+      if (fseek (f, 0L, SEEK_END) != 0 || (size = ftell (f)) < 0
+          || fseek (f, 0L, SEEK_SET) != 0)
+        error ("%s: %s", src_fname, strerror (errno));
+      if (size == 0 || size % 512 != 0)
+        error ("The length of the source file must be a non-zero "
+               "multiple of 512 bytes");
+    }
 
   d = diskio_open ((PCSZ)dst_fname, DIO_DISK | DIO_SNAPSHOT, TRUE);
-  ok = write_sec (d, data, n);
+  data = xmalloc (READ_WRITE_CHUNK * 512);
+  ok = TRUE; k = 0;
+  for (;;)
+    {
+      nread = fread (data, 1, READ_WRITE_CHUNK * 512, f);
+      if (ferror (f))
+        error ("%s: %s", src_fname, strerror (errno));
+      if (nread % 512 != 0 || (nread == 0 && k == 0))
+        error ("The length of the source file must be a non-zero "
+               "multiple of 512 bytes");
+      if (nread == 0)
+        break;
+      if (n + nread / 512 < n)
+        error ("Invalid sector range");
+      if (!write_sec (d, data, n, nread / 512))
+        ok = FALSE;
+      n += nread / 512; k += nread / 512;
+      if (nread < READ_WRITE_CHUNK * 512)
+        break;
+    }
+  if (f != stdin)
+    fclose (f);
+  free (data);
   diskio_close (d);
   quit (ok ? 0 : 2, FALSE);
 }
 
 
+/* Write a sparse CRC file for disk D to `save_fname'.  If MODE is
+   'm', the CRC file contains the CRCs of the sectors which would be
+   saved by the `save' action.  If MODE is 'a', the CRC file contains
+   the CRCs of the allocated sectors.  The CRCs are computed with the
+   hash algorithm ALG. */
+
+static void crc_sparse (DISKIO *d, const char *src_fname, int mode, int alg)
+{
+  ULONG *ranges;
+  ULONG r, secno, end, n, count, range_count;
+  hash_t *acrc;
+
+  /* Walk the file system, recording the sectors instead of saving
+     them. */
+
+  n = diskio_total_sectors (d);
+  save_map_create (n);
+  if (mode == 'm')
+    a_save = TRUE;
+  else
+    a_alloc = TRUE;
+  do_disk (d);
+  a_save = FALSE; a_alloc = FALSE;
+  ranges = save_map_ranges (&range_count);
+
+  save_crc_sparse (src_fname, n, ranges, range_count, alg);
+  acrc = xmalloc (CRC_FILE_CHUNK * sizeof (*acrc));
+  for (r = 0; r < range_count; ++r)
+    {
+      end = ranges[2*r+0] + ranges[2*r+1];
+      for (secno = ranges[2*r+0]; secno < end; secno += count)
+        {
+          count = MIN (end - secno, CRC_FILE_CHUNK);
+          diskio_crc_sectors (d, acrc, secno, count, 1, alg, threads);
+          save_crc_write (acrc, count);
+        }
+    }
+  free (acrc);
+  free (ranges);
+  save_sector_count = n;
+  save_close ();
+}
+
+
+/* Show the CRC of the sectors FIRST through LAST of D.  If D is a CRC
+   file named FNAME, the CRC is computed from the CRCs in the file
+   without accessing the disk.  Otherwise, the CRCs of the sectors are
+   computed and combined. */
+
+static void crc_range (DISKIO *d, const char *fname, ULONG first, ULONG last)
+{
+  ULONG secno, count, k;
+  crc_t crc;
+  hash_t *acrc;
+
+  if (diskio_type (d) == DIO_CRC)
+    {
+      if (diskio_crc_hash (d) != HASH_CRC32)
+        error ("%s does not contain CRC-32 values", fname);
+      if (!diskio_crc_range (d, first, last + 1, &crc))
+        error ("%s does not contain the CRCs of sectors #%lu-#%lu",
+               fname, first, last);
+    }
+  else
+    {
+      if (last >= diskio_total_sectors (d))
+        error ("Sector number #%lu is too big", last);
+      acrc = xmalloc (CRC_FILE_CHUNK * sizeof (*acrc));
+      crc = 0;
+      for (secno = first; secno <= last; secno += count)
+        {
+          count = MIN (last - secno + 1, CRC_FILE_CHUNK);
+          diskio_crc_sectors (d, acrc, secno, count, 1, HASH_CRC32, threads);
+          for (k = 0; k < count; ++k)
+            crc = crc_combine (crc, (crc_t)acrc[k], 512);
+        }
+      free (acrc);
+    }
+  info ("CRC of sectors #%lu-#%lu: 0x%.8lx\n", first, last, crc);
+}
+
+
 /* `crc' action. */
 
 static void cmd_crc (int argc, char *argv[])
@@ -1434,13 +3181,77 @@ static void cmd_crc (int argc, char *argv[])
   DISKIO *d;
   int i;
   const char *src_fname;
-  ULONG secno, n;
-  crc_t *acrc;
+  ULONG secno, n, count, block = 0, first = 0, last = 0;
+  hash_t *acrc;
+  char resume = FALSE, mode = 0, range = FALSE, *e;
+  int alg = HASH_CRC32;
 
   i = 1;
+  while (i < argc && argv[i][0] == '-')
+    if (strncmp (argv[i], "-j=", 3) == 0 && parse_threads (argv[i] + 3))
+      ++i;
+    else if (strncmp (argv[i], "-b=", 3) == 0)
+      {
+        /* Block size in bytes or, with `k' appended, in KiB. */
+
+        errno = 0;
+        block = strtoul (argv[i] + 3, &e, 0);
+        if (*e == 'k' || *e == 'K')
+          {
+            block *= 1024; ++e;
+          }
+        if (errno != 0 || e == argv[i] + 3 || *e != 0
+            || block < 512 || block > 1024 * 1024 || (block & (block - 1)))
+          usage_crc ();
+        block /= 512;
+        ++i;
+      }
+    else if (strcmp (argv[i], "-H=crc32") == 0)
+      {
+        alg = HASH_CRC32; ++i;
+      }
+    else if (strcmp (argv[i], "-H=xxh64") == 0)
+      {
+        alg = HASH_XXH64; ++i;
+      }
+    else if (strcmp (argv[i], "-resume") == 0)
+      {
+        resume = TRUE; ++i;
+      }
+    else if (strcmp (argv[i], "-m") == 0 || strcmp (argv[i], "-a") == 0)
+      {
+        mode = argv[i][1]; ++i;
+      }
+    else if (strncmp (argv[i], "-r=", 3) == 0)
+      {
+        /* Range of sectors: <first>-<last>. */
+
+        errno = 0;
+        first = strtoul (argv[i] + 3, &e, 0);
+        if (errno != 0 || e == argv[i] + 3 || *e != '-')
+          usage_crc ();
+        last = strtoul (e + 1, &e, 0);
+        if (errno != 0 || *e != 0 || last < first)
+          usage_crc ();
+        range = TRUE; ++i;
+      }
+    else
+      usage_crc ();
+  if (range)
+    {
+      if (argc - i != 1 || block != 0 || resume || mode != 0
+          || alg != HASH_CRC32)
+        usage_crc ();
+      src_fname = argv[i];
+      info_file = stdout; diag_file = stderr; prog_file = stderr;
+      d = diskio_open ((PCSZ)src_fname, DIO_DISK | DIO_CRC, FALSE);
+      crc_range (d, src_fname, first, last);
+      diskio_close (d);
+      return;
+    }
   if (argc - i != 2)
     usage_crc ();
-  if (argv[i][0] == '-')
+  if (mode != 0 && (block != 0 || resume))
     usage_crc ();
   if (diskio_access == ACCESS_DASD)
     error ("Cannot use the -d option with the `crc' action");
@@ -1448,18 +3259,38 @@ static void cmd_crc (int argc, char *argv[])
   save_fname = argv[i+1];
   info_file = stdout; diag_file = stderr; prog_file = stderr;
   d = diskio_open ((PCSZ)src_fname, DIO_DISK, FALSE);
-  save_create (src_fname, SAVE_CRC);
-  crc_build_table ();
+  if (mode != 0)
+    {
+      crc_sparse (d, src_fname, mode, alg);
+      diskio_close (d);
+      return;
+    }
   n = diskio_total_sectors (d);
-  acrc = xmalloc (n * sizeof (*acrc));
-  for (secno = 0; secno < n; ++secno)
+
+  /* Only CRC files of version 1 have no block size; they always
+     contain CRC-32 values. */
+
+  if (block == 0 && alg != HASH_CRC32)
+    block = 1;
+
+  /* Compute and write the CRCs chunk by chunk.  Each chunk is flushed
+     to the file so that an interrupted run can be resumed. */
+
+  secno = save_crc_begin (src_fname, n, block, alg, CRC_FILE_CHUNK, resume);
+  if (block == 0)
+    block = 1;
+  secno *= block;
+  acrc = xmalloc (CRC_FILE_CHUNK * sizeof (*acrc));
+  while (secno < n)
     {
-      if (!crc_sec (d, acrc + secno, secno))
-        warning (1, "Sector #%lu not readable", secno);
-      acrc[secno] = ULONG_TO_FS (acrc[secno]);
+      count = MIN (n - secno, CRC_FILE_CHUNK * block);
+      diskio_crc_sectors (d, acrc, secno, count, block, alg, threads);
+      count = DIVIDE_UP (count, block);
+      save_crc_write (acrc, count);
+      if (fflush (save_file) != 0)
+        save_error ();
+      secno += count * block;
     }
-  if (fwrite (acrc, sizeof (*acrc), n, save_file) != n)
-    save_error ();
   free (acrc);
   diskio_close (d);
   save_sector_count = n;
@@ -1483,6 +3314,11 @@ int main (int argc, char *argv[])
 
   init_cur_case_map ();
 
+  /* Initialize the CRC table.  It's also used for identifying the
+     base snapshot files of delta snapshot files. */
+
+  crc_build_table ();
+
   /* Parse initial command line options. */
 
   i = 1;
@@ -1539,6 +3375,18 @@ int main (int argc, char *argv[])
     cmd_restore (argc - i, argv + i);
   else if (strcmp (argv[i], "diff") == 0)
     cmd_diff (argc - i, argv + i);
+  else if (strcmp (argv[i], "treediff") == 0)
+    cmd_treediff (argc - i, argv + i);
+  else if (strcmp (argv[i], "merge") == 0)
+    cmd_merge (argc - i, argv + i);
+  else if (strcmp (argv[i], "export") == 0)
+    cmd_export (argc - i, argv + i);
+  else if (strcmp (argv[i], "image") == 0)
+    cmd_image (argc - i, argv + i);
+  else if (strcmp (argv[i], "trim") == 0)
+    cmd_trim (argc - i, argv + i);
+  else if (strcmp (argv[i], "verify") == 0)
+    cmd_verify (argc - i, argv + i);
   else if (strcmp (argv[i], "copy") == 0)
     cmd_copy (argc - i, argv + i);
   else if (strcmp (argv[i], "dir") == 0)
@@ -44,6 +44,9 @@ Boston, MA 02111-1307, USA.  */
 /* Return the smaller one of the two arguments. */
 #define MIN(x,y)         ((x) < (y) ? (x) : (y))
 
+/* Return the bigger one of the two arguments. */
+#define MAX(x,y)         ((x) > (y) ? (x) : (y))
+
 /* Round up X to the smallest multiple of Y which is >= X.  Y must be
    a power of two. */
 #define ROUND_UP(x,y)    (((x)+(y)-1) & ~((y)-1))
@@ -101,7 +104,7 @@ typedef struct path_chain
 } path_chain;
 
 #define PATH_CHAIN_NEW(L, P, N) \
-  (a_check && plenty_memory \
+  ((a_check && plenty_memory) || a_owner \
    ? path_chain_new ((P), (N)) \
    : ((L)->parent = (P), (L)->name = (N), (L)))
 
@@ -116,6 +119,9 @@ extern char a_where;
 extern char a_copy;
 extern char a_dir;
 extern char a_find;
+extern char a_alloc;
+extern char a_owner;
+extern char a_trim;
 extern char plenty_memory;
 extern char check_unused;
 extern char check_pedantic;
@@ -153,3 +159,5 @@ const char *format_path_chain (const path_chain *bottom, const char *last);
 void list_start (const char *fmt, ...) ATTR_PRINTF (1, 2);
 void list (const char *fmt, ...) ATTR_PRINTF (1, 2);
 void list_end (void);
+void owner_sectors (ULONG start, ULONG count, const char *what,
+                    const path_chain *path);